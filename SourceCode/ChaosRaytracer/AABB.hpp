@@ -1,9 +1,7 @@
 #pragma once
 
-#include <vector>
-
 #include "Vector3.hpp"
-#include "Triangle.hpp"
+#include "Ray.hpp"
 
 enum Axis {
     AxisX,
@@ -14,12 +12,15 @@ enum Axis {
 struct AABB {
     Vector3 min;
     Vector3 max;
-    AABB *parent;
-    AABB *childA;
-    AABB *childB;
-    std::vector<Triangle> triangles;
 
-    AABB(Vector3 _min, Vector3 _max) : min(_min), max(_max), childA(nullptr), childB(nullptr), parent(nullptr) {}
+    AABB() : AABB(Empty()) {}
+
+    AABB(Vector3 _min, Vector3 _max) : min(_min), max(_max) {}
+
+    static AABB Empty() {
+        const float inf = std::numeric_limits<float>::infinity();
+        return AABB(Vector3(inf, inf, inf), Vector3(-inf, -inf, -inf));
+    }
 
     void expandToInclude(const Vector3& point) {
         min.x = std::min(min.x, point.x);
@@ -30,64 +31,66 @@ struct AABB {
         max.z = std::max(max.z, point.z);
     }
 
-    bool intersect(const Vector3& rayOrigin, const Vector3& rayDir) const {
-        float tmin = (min.x - rayOrigin.x) / rayDir.x;
-        float tmax = (max.x - rayOrigin.x) / rayDir.x;
-        if (tmin > tmax) std::swap(tmin, tmax);
-
-        float tymin = (min.y - rayOrigin.y) / rayDir.y;
-        float tymax = (max.y - rayOrigin.y) / rayDir.y;
-        if (tymin > tymax) std::swap(tymin, tymax);
+    void expandToInclude(const AABB& other) {
+        min.x = std::min(min.x, other.min.x);
+        min.y = std::min(min.y, other.min.y);
+        min.z = std::min(min.z, other.min.z);
+        max.x = std::max(max.x, other.max.x);
+        max.y = std::max(max.y, other.max.y);
+        max.z = std::max(max.z, other.max.z);
+    }
 
-        if ((tmin > tymax) || (tymin > tmax)) return false;
+    AABB intersection(const AABB& other) const {
+        return AABB(
+            Vector3(std::max(min.x, other.min.x), std::max(min.y, other.min.y), std::max(min.z, other.min.z)),
+            Vector3(std::min(max.x, other.max.x), std::min(max.y, other.max.y), std::min(max.z, other.max.z))
+        );
+    }
 
-        tmin = std::max(tmin, tymin);
-        tmax = std::min(tmax, tymax);
+    inline bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
 
-        float tzmin = (min.z - rayOrigin.z) / rayDir.z;
-        float tzmax = (max.z - rayOrigin.z) / rayDir.z;
-        if (tzmin > tzmax) std::swap(tzmin, tzmax);
+    float surfaceArea() const {
+        Vector3 extent = max - min;
+        if (extent.x < 0 || extent.y < 0 || extent.z < 0) return 0;
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
 
-        if ((tmin > tzmax) || (tzmin > tmax)) return false;
+    inline Vector3 center() const { return (min + max) * 0.5f; }
 
-        return true;
+    static float axisValue(const Vector3& vector, int axis) {
+        return axis == AxisX ? vector.x : (axis == AxisY ? vector.y : vector.z);
     }
 
-    static AABB BuildAccTree(int depth, std::vector<Triangle>& triangles) {
-        if (depth > MAX_KDTREE_DEPTH || triangles.size() <= MIN_TRIANGLES_IN_NODE) {
-            AABB leafNode = AABB(triangles[0].vertexA, triangles[0].vertexA);
-            leafNode.triangles = triangles;
-            for (const auto& triangle : triangles) {
-                leafNode.expandToInclude(triangle.vertexA);
-                leafNode.expandToInclude(triangle.vertexB);
-                leafNode.expandToInclude(triangle.vertexC);
-            }
-            return leafNode;
-        }
-
-        Axis axis = (Axis)(depth % 3);
-        std::nth_element(triangles.begin(), triangles.begin() + triangles.size() / 2, triangles.end(), [axis](const Triangle& a, const Triangle& b) {
-            switch (axis) {
-                case AxisX: return a.centroid().x < b.centroid().x;
-                case AxisY: return a.centroid().y < b.centroid().y;
-                case AxisZ: return a.centroid().z < b.centroid().z;
-            }
-            throw "unknown axis";
-        });
-
-        std::vector<Triangle> leftTriangles(triangles.begin(), triangles.begin() + triangles.size() / 2);
-        std::vector<Triangle> rightTriangles(triangles.begin() + triangles.size() / 2, triangles.end());
-
-        AABB node = AABB(triangles[0].vertexA, triangles[0].vertexA);
-        node.childA = new AABB(BuildAccTree(depth + 1, leftTriangles));
-        node.childB = new AABB(BuildAccTree(depth + 1, rightTriangles));
-        node.expandToInclude(node.childA->min);
-        node.expandToInclude(node.childA->max);
-        node.expandToInclude(node.childB->min);
-        node.expandToInclude(node.childB->max);
-
-        return node;
+    // Slab test limited to [0, tMax], entryDistance is where the ray enters the box.
+    // Divide free: the near and far planes are picked by the ray's sign bits so no swaps are needed, and the
+    // comparisons are written so a NaN slab (origin on a plane of an axis the ray is parallel to) is skipped.
+    bool intersect(const Ray& ray, float tMax, float& entryDistance) const {
+        float exitDistance;
+        return clip(ray, tMax, entryDistance, exitDistance);
     }
 
-    inline bool isLeaf() const { return childA == nullptr && childB == nullptr; }
+    // The part [entryDistance, exitDistance] of [0, tMax] that lies inside the box
+    bool clip(const Ray& ray, float tMax, float& entryDistance, float& exitDistance) const {
+        float tEntry = 0.0f;
+        float tExit = tMax;
+
+        float nearX = ((ray.sign[0] ? max.x : min.x) - ray.origin.x) * ray.inverseDirection.x;
+        float farX = ((ray.sign[0] ? min.x : max.x) - ray.origin.x) * ray.inverseDirection.x;
+        tEntry = nearX > tEntry ? nearX : tEntry;
+        tExit = farX < tExit ? farX : tExit;
+
+        float nearY = ((ray.sign[1] ? max.y : min.y) - ray.origin.y) * ray.inverseDirection.y;
+        float farY = ((ray.sign[1] ? min.y : max.y) - ray.origin.y) * ray.inverseDirection.y;
+        tEntry = nearY > tEntry ? nearY : tEntry;
+        tExit = farY < tExit ? farY : tExit;
+
+        float nearZ = ((ray.sign[2] ? max.z : min.z) - ray.origin.z) * ray.inverseDirection.z;
+        float farZ = ((ray.sign[2] ? min.z : max.z) - ray.origin.z) * ray.inverseDirection.z;
+        tEntry = nearZ > tEntry ? nearZ : tEntry;
+        tExit = farZ < tExit ? farZ : tExit;
+
+        entryDistance = tEntry;
+        exitDistance = tExit;
+        return tEntry <= tExit;
+    }
 };
@@ -0,0 +1,198 @@
+#pragma once
+
+#include "AccTreeCache.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+inline void HashBytes(uint64_t& hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+}
+
+// The hash only covers the build inputs, so the contents of a tree are checked before they are trusted: children come after
+// their parent and stay within the tree and BVH_MAX_DEPTH, leaves stay within the indices and the indices within the mesh
+bool IsValidTree(const unsigned char* data, uint32_t nodeCount, uint32_t triangleIndexCount, int triangleCount) {
+    std::vector<int> depth(nodeCount, 0);
+    for (uint32_t i = 0; i < nodeCount; i++) {
+        BVHNode node;
+        std::memcpy(&node, data + (size_t)i * sizeof(BVHNode), sizeof(BVHNode));
+        if (node.isLeaf()) {
+            if (node.firstTriangle < 0 || (int64_t)node.firstTriangle + node.triangleCount > (int64_t)triangleIndexCount) return false;
+            continue;
+        }
+
+        if (i + 1 >= nodeCount || node.secondChild <= (int64_t)i + 1 || node.secondChild >= (int64_t)nodeCount) return false;
+        if (depth[i] >= BVH_MAX_DEPTH) return false;
+        depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+        depth[node.secondChild] = std::max(depth[node.secondChild], depth[i] + 1);
+    }
+
+    const unsigned char* indexData = data + (size_t)nodeCount * sizeof(BVHNode);
+    for (uint32_t i = 0; i < triangleIndexCount; i++) {
+        int triangleIndex;
+        std::memcpy(&triangleIndex, indexData + (size_t)i * sizeof(int), sizeof(int));
+        if (triangleIndex < 0 || triangleIndex >= triangleCount) return false;
+    }
+    return nodeCount > 0 || triangleIndexCount == 0;
+}
+
+// Read only view of a whole file, unmapped when it goes out of scope
+class MappedFile {
+public:
+    MappedFile(const std::string& path) : data(nullptr), size(0) {
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) return;
+        data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (data != nullptr) size = (size_t)fileSize.QuadPart;
+#else
+        descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return;
+        struct stat fileStat;
+        if (fstat(descriptor, &fileStat) != 0 || fileStat.st_size == 0) return;
+        void* mapped = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapped == MAP_FAILED) return;
+        data = (const unsigned char*)mapped;
+        size = (size_t)fileStat.st_size;
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(_WIN32)
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data != nullptr) munmap((void*)data, size);
+        if (descriptor >= 0) close(descriptor);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data;
+    size_t size;
+
+private:
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+};
+
+}
+
+uint64_t AccTreeCache::Hash(const std::vector<const Mesh*>& meshes, AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, int optimizationPasses) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    HashBytes(hash, &VERSION, sizeof(VERSION));
+    HashBytes(hash, &builder, sizeof(builder));
+    HashBytes(hash, &spatialSplitBudget, sizeof(spatialSplitBudget));
+    HashBytes(hash, &maxLeafSize, sizeof(maxLeafSize));
+    HashBytes(hash, &optimizationPasses, sizeof(optimizationPasses));
+
+    // The build constants change the resulting trees as much as the geometry does
+    const float buildConstants[] = { (float)SAH_BIN_COUNT, SAH_TRAVERSAL_COST, SAH_INTERSECTION_COST, (float)SAH_MAX_TRIANGLES_IN_LEAF, (float)BVH_MAX_DEPTH,
+        (float)SBVH_BIN_COUNT, SBVH_OVERLAP_THRESHOLD, (float)MEDIAN_SPLIT_MAX_DEPTH, (float)MIN_TRIANGLES_IN_NODE, (float)TREELET_SIZE,
+        (float)TRIANGLE_PACKET_WIDTH };
+    HashBytes(hash, buildConstants, sizeof(buildConstants));
+
+    for (const Mesh* mesh : meshes) {
+        uint64_t triangleCount = mesh->triangleCount();
+        HashBytes(hash, &triangleCount, sizeof(triangleCount));
+        for (int i = 0; i < mesh->triangleCount(); i++) {
+            Triangle triangle = mesh->triangle(i);
+            const float positions[] = { triangle.vertexA.x, triangle.vertexA.y, triangle.vertexA.z, triangle.vertexB.x, triangle.vertexB.y, triangle.vertexB.z, triangle.vertexC.x, triangle.vertexC.y, triangle.vertexC.z };
+            HashBytes(hash, positions, sizeof(positions));
+        }
+    }
+    return hash;
+}
+
+bool AccTreeCache::Load(const std::string& path, uint64_t hash, const std::vector<Mesh*>& meshes) {
+    MappedFile file(path);
+    if (file.data == nullptr || file.size < sizeof(FileHeader)) return false;
+
+    FileHeader fileHeader;
+    std::memcpy(&fileHeader, file.data, sizeof(FileHeader));
+    if (fileHeader.magic != MAGIC || fileHeader.version != VERSION || fileHeader.hash != hash || fileHeader.treeCount != meshes.size()) return false;
+
+    // Validate every section before filling any tree
+    std::vector<TreeHeader> treeHeaders(fileHeader.treeCount);
+    std::vector<size_t> treeOffsets(fileHeader.treeCount);
+    size_t offset = sizeof(FileHeader);
+    for (uint32_t i = 0; i < fileHeader.treeCount; i++) {
+        if (file.size - offset < sizeof(TreeHeader)) return false;
+        std::memcpy(&treeHeaders[i], file.data + offset, sizeof(TreeHeader));
+        offset += sizeof(TreeHeader);
+        treeOffsets[i] = offset;
+
+        size_t treeSize = (size_t)treeHeaders[i].nodeCount * sizeof(BVHNode) + (size_t)treeHeaders[i].triangleIndexCount * sizeof(int);
+        if (file.size - offset < treeSize) return false;
+        if (!IsValidTree(file.data + offset, treeHeaders[i].nodeCount, treeHeaders[i].triangleIndexCount, meshes[i]->triangleCount())) return false;
+        offset += treeSize;
+    }
+    if (offset != file.size) return false;
+
+    for (uint32_t i = 0; i < fileHeader.treeCount; i++) {
+        BVH& accTree = meshes[i]->accTree;
+        accTree.nodes.resize(treeHeaders[i].nodeCount);
+        accTree.triangleIndices.resize(treeHeaders[i].triangleIndexCount);
+        accTree.builtSahCost = treeHeaders[i].builtSahCost;
+
+        size_t nodesSize = accTree.nodes.size() * sizeof(BVHNode);
+        std::memcpy(accTree.nodes.data(), file.data + treeOffsets[i], nodesSize);
+        std::memcpy(accTree.triangleIndices.data(), file.data + treeOffsets[i] + nodesSize, accTree.triangleIndices.size() * sizeof(int));
+    }
+    return true;
+}
+
+bool AccTreeCache::Save(const std::string& path, uint64_t hash, const std::vector<const Mesh*>& meshes) {
+    // Written to a temporary file first so an interrupted run never leaves a truncated cache behind
+    std::string temporaryPath = path + ".tmp";
+    {
+        std::ofstream stream(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!stream.is_open()) return false;
+
+        FileHeader fileHeader = { MAGIC, VERSION, hash, (uint32_t)meshes.size(), 0 };
+        stream.write((const char*)&fileHeader, sizeof(FileHeader));
+        for (const Mesh* mesh : meshes) {
+            const BVH& accTree = mesh->accTree;
+            TreeHeader treeHeader = { (uint32_t)accTree.nodes.size(), (uint32_t)accTree.triangleIndices.size(), accTree.builtSahCost, 0 };
+            stream.write((const char*)&treeHeader, sizeof(TreeHeader));
+            stream.write((const char*)accTree.nodes.data(), accTree.nodes.size() * sizeof(BVHNode));
+            stream.write((const char*)accTree.triangleIndices.data(), accTree.triangleIndices.size() * sizeof(int));
+        }
+        if (!stream.good()) return false;
+    }
+
+    std::remove(path.c_str());
+    return std::rename(temporaryPath.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Mesh.hpp"
+
+// Binary trees of the scene meshes saved next to the scene file, keyed by a hash of the geometry and the build parameters
+struct AccTreeCache {
+    static constexpr uint32_t MAGIC = 0x42545243; // "CRTB"
+    static constexpr uint32_t VERSION = 1;
+
+    static uint64_t Hash(const std::vector<const Mesh*>& meshes, AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, int optimizationPasses);
+
+    // Fills accTree of every mesh from the memory mapped file, fails without touching them if the file is missing, stale or malformed
+    static bool Load(const std::string& path, uint64_t hash, const std::vector<Mesh*>& meshes);
+    static bool Save(const std::string& path, uint64_t hash, const std::vector<const Mesh*>& meshes);
+
+private:
+    struct FileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t hash;
+        uint32_t treeCount;
+        uint32_t padding;
+    };
+
+    struct TreeHeader {
+        uint32_t nodeCount;
+        uint32_t triangleIndexCount;
+        float builtSahCost;
+        uint32_t padding;
+    };
+};
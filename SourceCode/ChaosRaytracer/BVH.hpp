@@ -0,0 +1,858 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <thread>
+#include <cstdint>
+
+#include "Vector3.hpp"
+#include "Triangle.hpp"
+#include "AABB.hpp"
+#include "Parallel.hpp"
+#include "TrianglePacket.hpp"
+
+enum AccTreeBuilder {
+    MedianSplit,
+    BinnedSAH,
+    SpatialSplitSAH
+};
+
+// 32 byte node, the first child of an interior node directly follows it in the array
+struct BVHNode {
+    AABB bounds;
+    union {
+        int firstTriangle; // leaf
+        int secondChild;   // interior
+    };
+    uint16_t triangleCount;
+    uint8_t axis;
+    uint8_t padding;
+
+    BVHNode() : bounds(AABB::Empty()), firstTriangle(0), triangleCount(0), axis(0), padding(0) {}
+
+    inline bool isLeaf() const { return triangleCount > 0; }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode is expected to be 32 bytes");
+
+struct BVH {
+private:
+    struct BuildTriangle {
+        AABB bounds;      // clipped by spatial splits, so it can be smaller than the triangle
+        Vector3 centroid;
+        int index;
+    };
+
+    // Subtrees built on other threads are written into their own output and appended to the parent afterwards
+    struct BuildOutput {
+        std::vector<BVHNode> nodes;
+        std::vector<int> triangleIndices;
+
+        void append(const BuildOutput& subtree) {
+            int nodeOffset = (int)nodes.size();
+            int triangleOffset = (int)triangleIndices.size();
+            for (BVHNode node : subtree.nodes) {
+                if (node.isLeaf()) node.firstTriangle += triangleOffset;
+                else node.secondChild += nodeOffset;
+                nodes.push_back(node);
+            }
+            triangleIndices.insert(triangleIndices.end(), subtree.triangleIndices.begin(), subtree.triangleIndices.end());
+        }
+    };
+
+public:
+    // Scratch memory of the builders, owned by the caller and kept between builds so rebuilding reuses it instead of allocating
+    struct BuildArena {
+        std::vector<BuildTriangle> buildTriangles;
+        BuildOutput output;
+
+        void release() {
+            std::vector<BuildTriangle>().swap(buildTriangles);
+            std::vector<BVHNode>().swap(output.nodes);
+            std::vector<int>().swap(output.triangleIndices);
+        }
+
+        // Scratch kept from a much larger scene is released, builds of a similar size keep reusing it
+        void releaseIfOversized(size_t primitiveCount) {
+            if (buildTriangles.capacity() > BUILD_ARENA_MAX_OVERSIZE * std::max(primitiveCount, (size_t)PARALLEL_BUILD_MIN_TRIANGLES)) {
+                release();
+            }
+        }
+    };
+
+    std::vector<BVHNode> nodes;
+    std::vector<int> triangleIndices; // leaves refer to ranges of this array, which indexes the scene triangles
+    float builtSahCost = 0;
+
+    // spatialSplitBudget is the number of extra triangle references the SBVH builder may create, as a fraction of the triangle count.
+    // maxLeafSize limits the triangles per leaf, 0 keeps the builder's own limit
+    void build(const std::vector<Triangle>& triangles, AccTreeBuilder builder, float spatialSplitBudget = SBVH_DUPLICATION_BUDGET, int maxLeafSize = ACC_TREE_LEAF_SIZE) {
+        BuildArena arena;
+        build(triangles, builder, spatialSplitBudget, maxLeafSize, arena);
+    }
+
+    void build(const std::vector<Triangle>& triangles, AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, BuildArena& arena) {
+        nodes.clear();
+        triangleIndices.clear();
+        if (triangles.empty()) return;
+
+        std::vector<BuildTriangle>& buildTriangles = arena.buildTriangles;
+        buildTriangles.resize(triangles.size());
+        ParallelChunks(0, (int)triangles.size(), [&](int, int chunkBegin, int chunkEnd) {
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                buildTriangles[i].bounds = AABB::Empty();
+                buildTriangles[i].bounds.expandToInclude(triangles[i].vertexA);
+                buildTriangles[i].bounds.expandToInclude(triangles[i].vertexB);
+                buildTriangles[i].bounds.expandToInclude(triangles[i].vertexC);
+                buildTriangles[i].centroid = triangles[i].centroid();
+                buildTriangles[i].index = i;
+            }
+        });
+
+        buildFromReferences(buildTriangles, triangles, builder, spatialSplitBudget, maxLeafSize, arena.output);
+        builtSahCost = sahCost();
+    }
+
+    // Builds over arbitrary boxes, e.g. object instances, leaves then index primitiveBounds. Spatial splits need triangles and fall back to binned SAH
+    void build(const std::vector<AABB>& primitiveBounds, AccTreeBuilder builder, BuildArena& arena) {
+        nodes.clear();
+        triangleIndices.clear();
+        if (primitiveBounds.empty()) return;
+
+        std::vector<BuildTriangle>& buildTriangles = arena.buildTriangles;
+        buildTriangles.resize(primitiveBounds.size());
+        for (int i = 0; i < (int)primitiveBounds.size(); i++) {
+            buildTriangles[i].bounds = primitiveBounds[i];
+            buildTriangles[i].centroid = primitiveBounds[i].center();
+            buildTriangles[i].index = i;
+        }
+
+        const std::vector<Triangle> noTriangles;
+        buildFromReferences(buildTriangles, noTriangles, builder == SpatialSplitSAH ? BinnedSAH : builder, 0, ACC_TREE_LEAF_SIZE, arena.output);
+        builtSahCost = sahCost();
+    }
+
+    // Recomputes all bounds bottom-up for moved triangles, children always come after their parent in the array.
+    // Takes the triangles in the order the tree was built from, leaves read them through triangleIndices
+    void refit(const std::vector<Triangle>& triangles) {
+        RefitNodes(nodes, triangleIndices, triangles);
+    }
+
+    // The SAH cost right after a refit. Spatial splits clip the built bounds while a refit takes whole triangles, so the
+    // cost a refitted tree is compared against has to be measured this way too, or an unchanged SBVH looks degraded
+    float refitSahCost(const std::vector<Triangle>& triangles) const {
+        std::vector<BVHNode> refittedNodes = nodes;
+        RefitNodes(refittedNodes, triangleIndices, triangles);
+        return SahCost(refittedNodes);
+    }
+
+    // Treelet restructuring: every interior node, bottom-up, is taken as the root of a treelet of up to TREELET_SIZE subtrees,
+    // which is rearranged into the topology of lowest SAH cost found by dynamic programming over all subsets of the subtrees.
+    // Nodes of the same height have disjoint subtrees, so each height level is processed in parallel.
+    void optimize(int passes) {
+        if (nodes.empty() || nodes[0].isLeaf()) return;
+
+        for (int pass = 0; pass < passes; pass++) {
+            TreeletState state(nodes);
+
+            for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+                state.height[i] = nodes[i].isLeaf() ? 0 : 1 + std::max(state.height[state.left[i]], state.height[state.right[i]]);
+            }
+            std::vector<std::vector<int>> levels(state.height[0] + 1);
+            for (int i = 0; i < (int)nodes.size(); i++) {
+                if (!nodes[i].isLeaf()) levels[state.height[i]].push_back(i);
+            }
+
+            for (const auto& level : levels) {
+                ParallelChunks(0, (int)level.size(), [&](int, int chunkBegin, int chunkEnd) {
+                    for (int i = chunkBegin; i < chunkEnd; i++) {
+                        RestructureTreelet(state, level[i]);
+                    }
+                }, PARALLEL_TREELET_MIN_ROOTS);
+            }
+
+            // Restructuring can deepen the tree, traversal stacks are sized for BVH_MAX_DEPTH
+            std::vector<BVHNode> restructured;
+            restructured.reserve(nodes.size());
+            if (!LinearizeTreelets(state, 0, 0, restructured)) break;
+            nodes = std::move(restructured);
+        }
+
+        builtSahCost = sahCost();
+    }
+
+    // Expected cost of tracing a random ray that hits the root, used to tell how much a refitted tree degraded
+    float sahCost() const {
+        return SahCost(nodes);
+    }
+
+private:
+    static void RefitNodes(std::vector<BVHNode>& nodes, const std::vector<int>& triangleIndices, const std::vector<Triangle>& triangles) {
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            BVHNode& node = nodes[i];
+            node.bounds = AABB::Empty();
+            if (node.isLeaf()) {
+                for (int j = node.firstTriangle; j < node.firstTriangle + node.triangleCount; j++) {
+                    const Triangle& triangle = triangles[triangleIndices[j]];
+                    node.bounds.expandToInclude(triangle.vertexA);
+                    node.bounds.expandToInclude(triangle.vertexB);
+                    node.bounds.expandToInclude(triangle.vertexC);
+                }
+            }
+            else {
+                node.bounds.expandToInclude(nodes[i + 1].bounds);
+                node.bounds.expandToInclude(nodes[node.secondChild].bounds);
+            }
+        }
+    }
+
+    static float SahCost(const std::vector<BVHNode>& nodes) {
+        if (nodes.empty() || nodes[0].bounds.surfaceArea() == 0) return 0;
+
+        double cost = 0;
+        for (const auto& node : nodes) {
+            if (node.isLeaf()) cost += SAH_INTERSECTION_COST * node.triangleCount * node.bounds.surfaceArea();
+            else cost += SAH_TRAVERSAL_COST * node.bounds.surfaceArea();
+        }
+        return (float)(cost / nodes[0].bounds.surfaceArea());
+    }
+
+    // The tree is built into the arena output and copied to nodes, which keep their capacity when the same scene is rebuilt
+    void buildFromReferences(std::vector<BuildTriangle>& buildTriangles, const std::vector<Triangle>& triangles, AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, BuildOutput& output) {
+        BuildContext context(triangles, builder, maxLeafSize);
+
+        output.nodes.clear();
+        output.triangleIndices.clear();
+        output.nodes.reserve(2 * buildTriangles.size());
+        output.triangleIndices.reserve(buildTriangles.size());
+        if (builder == SpatialSplitSAH) {
+            context.rootSurfaceArea = NodeBounds(buildTriangles, 0, (int)buildTriangles.size(), 0).first.surfaceArea();
+            long long duplicationBudget = (long long)(buildTriangles.size() * std::max(0.0f, spatialSplitBudget));
+            buildSpatialNode(buildTriangles, 0, duplicationBudget, context, output);
+        }
+        else {
+            buildNode(buildTriangles, 0, (int)buildTriangles.size(), 0, context, output);
+        }
+
+        nodes.assign(output.nodes.begin(), output.nodes.end());
+        triangleIndices.assign(output.triangleIndices.begin(), output.triangleIndices.end());
+    }
+
+    struct Bin {
+        AABB bounds = AABB::Empty();
+        int count = 0;
+    };
+
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity(); // sum of surface area times triangle count of both children
+        int axis = -1;
+        int bin = -1; // last bin that goes to the left child
+        AABB leftBounds = AABB::Empty();
+        AABB rightBounds = AABB::Empty();
+    };
+
+    struct BuildContext {
+        const std::vector<Triangle>& triangles;
+        AccTreeBuilder builder;
+        int maxLeafSize;
+        float rootSurfaceArea;
+
+        BuildContext(const std::vector<Triangle>& _triangles, AccTreeBuilder _builder, int _maxLeafSize)
+            : triangles(_triangles), builder(_builder), maxLeafSize(_maxLeafSize > 0 ? _maxLeafSize : (_builder == MedianSplit ? MIN_TRIANGLES_IN_NODE : SAH_MAX_TRIANGLES_IN_LEAF)),
+            rootSurfaceArea(0) {}
+    };
+
+    // Explicit child links used while treelets are restructured, indices are the ones of the tree being optimized
+    struct TreeletState {
+        const std::vector<BVHNode>& nodes;
+        std::vector<int> left;
+        std::vector<int> right;
+        std::vector<AABB> bounds;
+        std::vector<float> cost; // SAH cost of the subtree, not normalized
+        std::vector<int> height;
+
+        TreeletState(const std::vector<BVHNode>& _nodes) : nodes(_nodes), left(_nodes.size(), -1), right(_nodes.size(), -1), bounds(_nodes.size()), cost(_nodes.size(), 0), height(_nodes.size(), 0) {
+            for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+                bounds[i] = nodes[i].bounds;
+                if (nodes[i].isLeaf()) {
+                    cost[i] = SAH_INTERSECTION_COST * nodes[i].triangleCount * bounds[i].surfaceArea();
+                }
+                else {
+                    left[i] = i + 1;
+                    right[i] = nodes[i].secondChild;
+                    cost[i] = SAH_TRAVERSAL_COST * bounds[i].surfaceArea() + cost[left[i]] + cost[right[i]];
+                }
+            }
+        }
+    };
+
+    static void RestructureTreelet(TreeletState& state, int root) {
+        int treeletLeaves[TREELET_SIZE];
+        int treeletInternals[TREELET_SIZE];
+        int leafCount = 0;
+        int internalCount = 0;
+
+        treeletInternals[internalCount++] = root;
+        treeletLeaves[leafCount++] = state.left[root];
+        treeletLeaves[leafCount++] = state.right[root];
+
+        // Grow the treelet by opening the interior leaf with the largest surface area
+        while (leafCount < TREELET_SIZE) {
+            int largest = -1;
+            float largestArea = -1;
+            for (int i = 0; i < leafCount; i++) {
+                int node = treeletLeaves[i];
+                if (state.left[node] != -1 && state.bounds[node].surfaceArea() > largestArea) {
+                    largest = i;
+                    largestArea = state.bounds[node].surfaceArea();
+                }
+            }
+            if (largest == -1) break;
+
+            int opened = treeletLeaves[largest];
+            treeletInternals[internalCount++] = opened;
+            treeletLeaves[largest] = state.left[opened];
+            treeletLeaves[leafCount++] = state.right[opened];
+        }
+        if (leafCount < 3) return;
+
+        // Optimal cost of every subset of the treelet leaves, a subset is only split after all its own subsets
+        const int subsetCount = 1 << leafCount;
+        AABB subsetBounds[1 << TREELET_SIZE];
+        float subsetCost[1 << TREELET_SIZE];
+        int bestPartition[1 << TREELET_SIZE];
+
+        for (int subset = 1; subset < subsetCount; subset++) {
+            int lowestBit = subset & -subset;
+            int lowestLeaf = 0;
+            while ((1 << lowestLeaf) != lowestBit) lowestLeaf++;
+
+            if (subset == lowestBit) {
+                subsetBounds[subset] = state.bounds[treeletLeaves[lowestLeaf]];
+                subsetCost[subset] = state.cost[treeletLeaves[lowestLeaf]];
+                bestPartition[subset] = 0;
+                continue;
+            }
+
+            subsetBounds[subset] = subsetBounds[subset ^ lowestBit];
+            subsetBounds[subset].expandToInclude(subsetBounds[lowestBit]);
+
+            // Only partitions that keep the lowest leaf on the left, the mirrored ones cost the same
+            float bestCost = std::numeric_limits<float>::infinity();
+            int best = 0;
+            for (int partition = (subset - 1) & subset; partition > 0; partition = (partition - 1) & subset) {
+                if (!(partition & lowestBit)) continue;
+                float cost = subsetCost[partition] + subsetCost[subset ^ partition];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    best = partition;
+                }
+            }
+            subsetCost[subset] = SAH_TRAVERSAL_COST * subsetBounds[subset].surfaceArea() + bestCost;
+            bestPartition[subset] = best;
+        }
+
+        const int allLeaves = subsetCount - 1;
+        if (subsetCost[allLeaves] >= state.cost[root] * (1 - 1e-5f)) return;
+
+        // Reuse the treelet's interior nodes for the new topology, the root keeps its index
+        int nextInternal = 1;
+        RebuildTreelet(state, allLeaves, root, treeletLeaves, treeletInternals, nextInternal, subsetBounds, subsetCost, bestPartition);
+    }
+
+    static void RebuildTreelet(TreeletState& state, int subset, int node, const int* treeletLeaves, const int* treeletInternals, int& nextInternal,
+        const AABB* subsetBounds, const float* subsetCost, const int* bestPartition) {
+        int children[2] = { bestPartition[subset], subset ^ bestPartition[subset] };
+        int childNodes[2];
+        for (int i = 0; i < 2; i++) {
+            if ((children[i] & (children[i] - 1)) == 0) {
+                int leaf = 0;
+                while ((1 << leaf) != children[i]) leaf++;
+                childNodes[i] = treeletLeaves[leaf];
+            }
+            else {
+                childNodes[i] = treeletInternals[nextInternal++];
+                RebuildTreelet(state, children[i], childNodes[i], treeletLeaves, treeletInternals, nextInternal, subsetBounds, subsetCost, bestPartition);
+            }
+        }
+
+        state.left[node] = childNodes[0];
+        state.right[node] = childNodes[1];
+        state.bounds[node] = subsetBounds[subset];
+        state.cost[node] = subsetCost[subset];
+    }
+
+    // Writes the subtree depth first so the first child follows its parent again, fails when the tree got too deep
+    static bool LinearizeTreelets(const TreeletState& state, int node, int depth, std::vector<BVHNode>& output) {
+        if (depth > BVH_MAX_DEPTH) return false;
+
+        int outputIndex = (int)output.size();
+        output.push_back(state.nodes[node]);
+        output[outputIndex].bounds = state.bounds[node];
+        if (state.left[node] == -1) return true;
+
+        AABB leftBounds = state.bounds[state.left[node]];
+        AABB rightBounds = state.bounds[state.right[node]];
+        Vector3 centerDistance = rightBounds.center() - leftBounds.center();
+        float distances[3] = { std::fabs(centerDistance.x), std::fabs(centerDistance.y), std::fabs(centerDistance.z) };
+        output[outputIndex].axis = (uint8_t)(std::max_element(distances, distances + 3) - distances);
+
+        if (!LinearizeTreelets(state, state.left[node], depth + 1, output)) return false;
+        output[outputIndex].secondChild = (int)output.size();
+        return LinearizeTreelets(state, state.right[node], depth + 1, output);
+    }
+
+    // Only the root is split into chunks. Every node below it with enough triangles to be chunked is already built on a
+    // subtree thread of BuildChildren, chunking it too would start worker threads from each of those threads
+    template <typename T, typename Function, typename Combine>
+    static T ParallelReduce(int begin, int end, int depth, Function function, Combine combine) {
+        if (depth > 0 || end - begin < PARALLEL_BINNING_MIN_TRIANGLES) {
+            return function(begin, end);
+        }
+
+        std::vector<T> results(THREADS_TO_USE);
+        ParallelChunks(begin, end, [&](int chunkIndex, int chunkBegin, int chunkEnd) {
+            results[chunkIndex] = function(chunkBegin, chunkEnd);
+        });
+
+        T result = results[0];
+        for (int i = 1; i < THREADS_TO_USE; i++) {
+            result = combine(result, results[i]);
+        }
+        return result;
+    }
+
+    // Subtrees above this depth are built on threads of their own, a single worker thread builds everything itself
+    static int BuildTaskDepth() {
+        if (THREADS_TO_USE == 1) return 0;
+
+        int depth = 1;
+        while ((1 << depth) < THREADS_TO_USE) depth++;
+        return depth + 1;
+    }
+
+    // Bounds of the triangles and bounds of their centroids
+    static std::pair<AABB, AABB> NodeBounds(const std::vector<BuildTriangle>& buildTriangles, int begin, int end, int depth) {
+        using BoundsPair = std::pair<AABB, AABB>;
+        return ParallelReduce<BoundsPair>(begin, end, depth, [&](int chunkBegin, int chunkEnd) {
+            BoundsPair chunkBounds = { AABB::Empty(), AABB::Empty() };
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                chunkBounds.first.expandToInclude(buildTriangles[i].bounds);
+                chunkBounds.second.expandToInclude(buildTriangles[i].centroid);
+            }
+            return chunkBounds;
+        }, [](BoundsPair a, const BoundsPair& b) {
+            a.first.expandToInclude(b.first);
+            a.second.expandToInclude(b.second);
+            return a;
+        });
+    }
+
+    // BVHNode::triangleCount is 16 bits, larger nodes that cannot be split (e.g. many triangles sharing one centroid) are cut at the median instead
+    static constexpr int MAX_LEAF_TRIANGLES = UINT16_MAX;
+
+    // Splits [begin, end) into halves along the longest centroid axis, returns the middle and sets axis
+    static int PartitionAtMedian(std::vector<BuildTriangle>& buildTriangles, int begin, int end, const AABB& centroidBounds, int& axis) {
+        Vector3 extent = centroidBounds.max - centroidBounds.min;
+        axis = extent.x > extent.y && extent.x > extent.z ? AxisX : (extent.y > extent.z ? AxisY : AxisZ);
+        int middle = begin + (end - begin) / 2;
+        std::nth_element(buildTriangles.begin() + begin, buildTriangles.begin() + middle, buildTriangles.begin() + end, [axis](const BuildTriangle& a, const BuildTriangle& b) {
+            return AABB::axisValue(a.centroid, axis) < AABB::axisValue(b.centroid, axis);
+        });
+        return middle;
+    }
+
+    static void MakeLeaf(const std::vector<BuildTriangle>& buildTriangles, int begin, int end, int nodeIndex, BuildOutput& output) {
+        output.nodes[nodeIndex].firstTriangle = (int)output.triangleIndices.size();
+        output.nodes[nodeIndex].triangleCount = (uint16_t)(end - begin);
+        for (int i = begin; i < end; i++) {
+            output.triangleIndices.push_back(buildTriangles[i].index);
+        }
+    }
+
+    // Leaves are intersected a triangle packet at a time, so a leaf costs its packets and the children are estimated as full packets
+    static bool IsLeafCheaper(float splitCost, int count, const AABB& bounds, int maxLeafSize) {
+        float leafCost = SAH_INTERSECTION_COST * TrianglePacketCount(count);
+        return leafCost <= SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * splitCost / (TRIANGLE_PACKET_WIDTH * bounds.surfaceArea()) && count <= maxLeafSize;
+    }
+
+    // Builds both children of nodeIndex, the left one on another thread when the node is large and close to the root
+    template <typename BuildLeft, typename BuildRight>
+    static void BuildChildren(int nodeIndex, int count, int depth, BuildOutput& output, BuildLeft buildLeft, BuildRight buildRight) {
+        if (count >= PARALLEL_BUILD_MIN_TRIANGLES && depth < BuildTaskDepth()) {
+            BuildOutput leftOutput;
+            BuildOutput rightOutput;
+            std::thread leftThread([&]() {
+                buildLeft(leftOutput);
+            });
+            buildRight(rightOutput);
+            leftThread.join();
+
+            output.append(leftOutput);
+            int secondChild = (int)output.nodes.size();
+            output.append(rightOutput);
+            output.nodes[nodeIndex].secondChild = secondChild;
+            return;
+        }
+
+        buildLeft(output);
+        int secondChild = (int)output.nodes.size();
+        buildRight(output);
+        output.nodes[nodeIndex].secondChild = secondChild;
+    }
+
+    // Median and binned SAH builders, both partition [begin, end) of buildTriangles in place
+    void buildNode(std::vector<BuildTriangle>& buildTriangles, int begin, int end, int depth, BuildContext& context, BuildOutput& output) {
+        int nodeIndex = (int)output.nodes.size();
+        output.nodes.emplace_back();
+
+        std::pair<AABB, AABB> nodeBounds = NodeBounds(buildTriangles, begin, end, depth);
+        const AABB& bounds = nodeBounds.first;
+        const AABB& centroidBounds = nodeBounds.second;
+        output.nodes[nodeIndex].bounds = bounds;
+
+        int axis = -1;
+        int middle = -1;
+        if (context.builder == BinnedSAH && depth < BVH_MAX_DEPTH && end - begin > 1) {
+            Split split = findObjectSplit(buildTriangles, begin, end, centroidBounds, depth);
+            if (split.axis != -1 && !IsLeafCheaper(split.cost, end - begin, bounds, context.maxLeafSize)) {
+                axis = split.axis;
+                middle = partitionObjectSplit(buildTriangles, begin, end, centroidBounds, split);
+            }
+        }
+        else if (context.builder == MedianSplit && depth <= MEDIAN_SPLIT_MAX_DEPTH && end - begin > context.maxLeafSize) {
+            axis = depth % 3;
+            middle = begin + (end - begin) / 2;
+            std::nth_element(buildTriangles.begin() + begin, buildTriangles.begin() + middle, buildTriangles.begin() + end, [axis](const BuildTriangle& a, const BuildTriangle& b) {
+                return AABB::axisValue(a.centroid, axis) < AABB::axisValue(b.centroid, axis);
+            });
+        }
+
+        if (axis == -1 && end - begin > MAX_LEAF_TRIANGLES) {
+            middle = PartitionAtMedian(buildTriangles, begin, end, centroidBounds, axis);
+        }
+        if (axis == -1) {
+            MakeLeaf(buildTriangles, begin, end, nodeIndex, output);
+            return;
+        }
+
+        output.nodes[nodeIndex].axis = (uint8_t)axis;
+        BuildChildren(nodeIndex, end - begin, depth, output,
+            [&](BuildOutput& childOutput) { buildNode(buildTriangles, begin, middle, depth + 1, context, childOutput); },
+            [&](BuildOutput& childOutput) { buildNode(buildTriangles, middle, end, depth + 1, context, childOutput); });
+    }
+
+    // SBVH builder, picks the cheaper of the best object split and the best spatial split. Spatial splits
+    // clip the triangles that straddle the plane and reference them from both children.
+    // Each subtree gets its own share of the duplication budget, so the tree does not depend on which subtree thread runs first
+    void buildSpatialNode(std::vector<BuildTriangle>& references, int depth, long long duplicationBudget, BuildContext& context, BuildOutput& output) {
+        int nodeIndex = (int)output.nodes.size();
+        output.nodes.emplace_back();
+
+        int count = (int)references.size();
+        std::pair<AABB, AABB> nodeBounds = NodeBounds(references, 0, count, depth);
+        const AABB& bounds = nodeBounds.first;
+        const AABB& centroidBounds = nodeBounds.second;
+        output.nodes[nodeIndex].bounds = bounds;
+
+        if (depth >= BVH_MAX_DEPTH || count == 1) {
+            makeSpatialLeaf(references, centroidBounds, nodeIndex, depth, duplicationBudget, context, output);
+            return;
+        }
+
+        Split objectSplit = findObjectSplit(references, 0, count, centroidBounds, depth);
+        Split spatialSplit;
+
+        // Spatial splits only pay off where the children of the object split overlap noticeably
+        AABB overlap = objectSplit.leftBounds.intersection(objectSplit.rightBounds);
+        if (objectSplit.axis == -1 || overlap.surfaceArea() > SBVH_OVERLAP_THRESHOLD * context.rootSurfaceArea) {
+            spatialSplit = findSpatialSplit(references, bounds, context);
+        }
+
+        bool useSpatialSplit = spatialSplit.cost < objectSplit.cost;
+        float bestCost = std::min(spatialSplit.cost, objectSplit.cost);
+        if (bestCost == std::numeric_limits<float>::infinity() || IsLeafCheaper(bestCost, count, bounds, context.maxLeafSize)) {
+            makeSpatialLeaf(references, centroidBounds, nodeIndex, depth, duplicationBudget, context, output);
+            return;
+        }
+
+        std::vector<BuildTriangle> leftReferences;
+        std::vector<BuildTriangle> rightReferences;
+        if (useSpatialSplit && !performSpatialSplit(references, bounds, spatialSplit, context, duplicationBudget, leftReferences, rightReferences)) {
+            if (objectSplit.axis == -1) {
+                makeSpatialLeaf(references, centroidBounds, nodeIndex, depth, duplicationBudget, context, output);
+                return;
+            }
+            useSpatialSplit = false;
+        }
+        if (!useSpatialSplit) {
+            int middle = partitionObjectSplit(references, 0, count, centroidBounds, objectSplit);
+            leftReferences.assign(references.begin(), references.begin() + middle);
+            rightReferences.assign(references.begin() + middle, references.end());
+        }
+
+        output.nodes[nodeIndex].axis = (uint8_t)(useSpatialSplit ? spatialSplit.axis : objectSplit.axis);
+        std::vector<BuildTriangle>().swap(references);
+        buildSpatialChildren(leftReferences, rightReferences, nodeIndex, count, depth, duplicationBudget, context, output);
+    }
+
+    void makeSpatialLeaf(std::vector<BuildTriangle>& references, const AABB& centroidBounds, int nodeIndex, int depth, long long duplicationBudget, BuildContext& context, BuildOutput& output) {
+        int count = (int)references.size();
+        if (count <= MAX_LEAF_TRIANGLES) {
+            MakeLeaf(references, 0, count, nodeIndex, output);
+            return;
+        }
+
+        int axis;
+        int middle = PartitionAtMedian(references, 0, count, centroidBounds, axis);
+        std::vector<BuildTriangle> leftReferences(references.begin(), references.begin() + middle);
+        std::vector<BuildTriangle> rightReferences(references.begin() + middle, references.end());
+        output.nodes[nodeIndex].axis = (uint8_t)axis;
+        std::vector<BuildTriangle>().swap(references);
+        buildSpatialChildren(leftReferences, rightReferences, nodeIndex, count, depth, duplicationBudget, context, output);
+    }
+
+    // The remaining duplication budget is split between the children in proportion to their reference counts
+    void buildSpatialChildren(std::vector<BuildTriangle>& leftReferences, std::vector<BuildTriangle>& rightReferences, int nodeIndex, int count, int depth,
+        long long duplicationBudget, BuildContext& context, BuildOutput& output) {
+        long long leftBudget = duplicationBudget * (long long)leftReferences.size() / (long long)(leftReferences.size() + rightReferences.size());
+        long long rightBudget = duplicationBudget - leftBudget;
+        BuildChildren(nodeIndex, count, depth, output,
+            [&](BuildOutput& childOutput) { buildSpatialNode(leftReferences, depth + 1, leftBudget, context, childOutput); },
+            [&](BuildOutput& childOutput) { buildSpatialNode(rightReferences, depth + 1, rightBudget, context, childOutput); });
+    }
+
+    // Binned SAH object split over all three axes
+    Split findObjectSplit(const std::vector<BuildTriangle>& buildTriangles, int begin, int end, const AABB& centroidBounds, int depth) {
+        float axisMins[3];
+        float binScales[3];
+        for (int candidateAxis = AxisX; candidateAxis <= AxisZ; candidateAxis++) {
+            axisMins[candidateAxis] = AABB::axisValue(centroidBounds.min, candidateAxis);
+            binScales[candidateAxis] = BinScale(centroidBounds, candidateAxis, SAH_BIN_COUNT);
+        }
+
+        // A large root is binned by all worker threads and the bins merged afterwards
+        using AxisBins = std::array<Bin, 3 * SAH_BIN_COUNT>;
+        AxisBins allBins = ParallelReduce<AxisBins>(begin, end, depth, [&](int chunkBegin, int chunkEnd) {
+            AxisBins bins;
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                const Vector3& centroid = buildTriangles[i].centroid;
+                int binX = BinOf(centroid.x, axisMins[AxisX], binScales[AxisX], SAH_BIN_COUNT);
+                int binY = BinOf(centroid.y, axisMins[AxisY], binScales[AxisY], SAH_BIN_COUNT);
+                int binZ = BinOf(centroid.z, axisMins[AxisZ], binScales[AxisZ], SAH_BIN_COUNT);
+
+                bins[AxisX * SAH_BIN_COUNT + binX].count++;
+                bins[AxisX * SAH_BIN_COUNT + binX].bounds.expandToInclude(buildTriangles[i].bounds);
+                bins[AxisY * SAH_BIN_COUNT + binY].count++;
+                bins[AxisY * SAH_BIN_COUNT + binY].bounds.expandToInclude(buildTriangles[i].bounds);
+                bins[AxisZ * SAH_BIN_COUNT + binZ].count++;
+                bins[AxisZ * SAH_BIN_COUNT + binZ].bounds.expandToInclude(buildTriangles[i].bounds);
+            }
+            return bins;
+        }, [](AxisBins a, const AxisBins& b) {
+            for (int i = 0; i < 3 * SAH_BIN_COUNT; i++) {
+                a[i].count += b[i].count;
+                a[i].bounds.expandToInclude(b[i].bounds);
+            }
+            return a;
+        });
+
+        Split best;
+        for (int candidateAxis = AxisX; candidateAxis <= AxisZ; candidateAxis++) {
+            if (binScales[candidateAxis] == 0) continue;
+
+            const Bin* bins = &allBins[candidateAxis * SAH_BIN_COUNT];
+            int entries[SAH_BIN_COUNT];
+            for (int i = 0; i < SAH_BIN_COUNT; i++) {
+                entries[i] = bins[i].count;
+            }
+            SweepBins(bins, entries, entries, SAH_BIN_COUNT, candidateAxis, best);
+        }
+        return best;
+    }
+
+    int partitionObjectSplit(std::vector<BuildTriangle>& buildTriangles, int begin, int end, const AABB& centroidBounds, const Split& split) {
+        float axisMin = AABB::axisValue(centroidBounds.min, split.axis);
+        float binScale = BinScale(centroidBounds, split.axis, SAH_BIN_COUNT);
+        int axis = split.axis;
+        int lastLeftBin = split.bin;
+        auto middle = std::partition(buildTriangles.begin() + begin, buildTriangles.begin() + end, [=](const BuildTriangle& buildTriangle) {
+            return BinOf(AABB::axisValue(buildTriangle.centroid, axis), axisMin, binScale, SAH_BIN_COUNT) <= lastLeftBin;
+        });
+        return (int)(middle - buildTriangles.begin());
+    }
+
+    // Spatial bins span the node bounds, every reference is clipped into each bin it overlaps
+    Split findSpatialSplit(const std::vector<BuildTriangle>& references, const AABB& bounds, const BuildContext& context) {
+        Split best;
+        for (int axis = AxisX; axis <= AxisZ; axis++) {
+            float axisMin = AABB::axisValue(bounds.min, axis);
+            float binScale = BinScale(bounds, axis, SBVH_BIN_COUNT);
+            if (binScale == 0) continue;
+            float binWidth = 1.0f / binScale;
+
+            Bin bins[SBVH_BIN_COUNT];
+            int entries[SBVH_BIN_COUNT] = {};
+            int exits[SBVH_BIN_COUNT] = {};
+
+            for (const auto& reference : references) {
+                int firstBin = BinOf(AABB::axisValue(reference.bounds.min, axis), axisMin, binScale, SBVH_BIN_COUNT);
+                int lastBin = BinOf(AABB::axisValue(reference.bounds.max, axis), axisMin, binScale, SBVH_BIN_COUNT);
+                entries[firstBin]++;
+                exits[lastBin]++;
+
+                if (firstBin == lastBin) {
+                    bins[firstBin].bounds.expandToInclude(reference.bounds);
+                    continue;
+                }
+                const Triangle& triangle = context.triangles[reference.index];
+                for (int bin = firstBin; bin <= lastBin; bin++) {
+                    float planeMin = axisMin + bin * binWidth;
+                    float planeMax = bin == SBVH_BIN_COUNT - 1 ? AABB::axisValue(bounds.max, axis) : axisMin + (bin + 1) * binWidth;
+                    bins[bin].bounds.expandToInclude(ClipTriangle(triangle, axis, planeMin, planeMax).intersection(reference.bounds));
+                }
+            }
+
+            SweepBins(bins, entries, exits, SBVH_BIN_COUNT, axis, best);
+        }
+
+        // A split that keeps every reference on one side does not make progress
+        if (best.axis != -1) {
+            int leftCount = 0;
+            int rightCount = 0;
+            float axisMin = AABB::axisValue(bounds.min, best.axis);
+            float binScale = BinScale(bounds, best.axis, SBVH_BIN_COUNT);
+            for (const auto& reference : references) {
+                if (BinOf(AABB::axisValue(reference.bounds.min, best.axis), axisMin, binScale, SBVH_BIN_COUNT) <= best.bin) leftCount++;
+                if (BinOf(AABB::axisValue(reference.bounds.max, best.axis), axisMin, binScale, SBVH_BIN_COUNT) > best.bin) rightCount++;
+            }
+            if (leftCount == (int)references.size() || rightCount == (int)references.size()) {
+                return Split();
+            }
+        }
+        return best;
+    }
+
+    // Returns false when the duplicated references would exceed the budget, which is reduced by them otherwise
+    bool performSpatialSplit(const std::vector<BuildTriangle>& references, const AABB& bounds, const Split& split, BuildContext& context, long long& duplicationBudget,
+        std::vector<BuildTriangle>& leftReferences, std::vector<BuildTriangle>& rightReferences) {
+        float axisMin = AABB::axisValue(bounds.min, split.axis);
+        float binScale = BinScale(bounds, split.axis, SBVH_BIN_COUNT);
+        float plane = axisMin + (split.bin + 1) / binScale;
+
+        long long duplicates = 0;
+        for (const auto& reference : references) {
+            int firstBin = BinOf(AABB::axisValue(reference.bounds.min, split.axis), axisMin, binScale, SBVH_BIN_COUNT);
+            int lastBin = BinOf(AABB::axisValue(reference.bounds.max, split.axis), axisMin, binScale, SBVH_BIN_COUNT);
+            if (firstBin <= split.bin && lastBin > split.bin) duplicates++;
+        }
+        if (duplicates > duplicationBudget) {
+            return false;
+        }
+
+        const float inf = std::numeric_limits<float>::infinity();
+        for (const auto& reference : references) {
+            int firstBin = BinOf(AABB::axisValue(reference.bounds.min, split.axis), axisMin, binScale, SBVH_BIN_COUNT);
+            int lastBin = BinOf(AABB::axisValue(reference.bounds.max, split.axis), axisMin, binScale, SBVH_BIN_COUNT);
+            if (lastBin <= split.bin) {
+                leftReferences.push_back(reference);
+            }
+            else if (firstBin > split.bin) {
+                rightReferences.push_back(reference);
+            }
+            else {
+                const Triangle& triangle = context.triangles[reference.index];
+                BuildTriangle leftPart = reference;
+                BuildTriangle rightPart = reference;
+                leftPart.bounds = ClipTriangle(triangle, split.axis, -inf, plane).intersection(reference.bounds);
+                rightPart.bounds = ClipTriangle(triangle, split.axis, plane, inf).intersection(reference.bounds);
+                leftPart.centroid = leftPart.bounds.center();
+                rightPart.centroid = rightPart.bounds.center();
+                if (!leftPart.bounds.isEmpty()) leftReferences.push_back(leftPart);
+                if (!rightPart.bounds.isEmpty()) rightReferences.push_back(rightPart);
+                // Every triangle has to stay in some leaf, one that rounding clipped away on both sides is kept whole
+                if (leftPart.bounds.isEmpty() && rightPart.bounds.isEmpty()) leftReferences.push_back(reference);
+            }
+        }
+
+        if (leftReferences.empty() || rightReferences.empty()) {
+            return false;
+        }
+        duplicationBudget -= duplicates;
+        return true;
+    }
+
+    // Evaluates every plane between two bins, entries and exits count the triangles starting and ending in each bin
+    static void SweepBins(const Bin* bins, const int* entries, const int* exits, int binCount, int axis, Split& best) {
+        const int maxBinCount = SAH_BIN_COUNT > SBVH_BIN_COUNT ? SAH_BIN_COUNT : SBVH_BIN_COUNT;
+        float rightAreas[maxBinCount];
+        int rightCounts[maxBinCount];
+        AABB rightBoxes[maxBinCount];
+
+        // Sweep from the right first, then evaluate every split plane while sweeping from the left
+        AABB rightBounds = AABB::Empty();
+        int rightCount = 0;
+        for (int i = binCount - 1; i > 0; i--) {
+            rightBounds.expandToInclude(bins[i].bounds);
+            rightCount += exits[i];
+            rightBoxes[i] = rightBounds;
+            rightAreas[i] = rightBounds.surfaceArea();
+            rightCounts[i] = rightCount;
+        }
+
+        AABB leftBounds = AABB::Empty();
+        int leftCount = 0;
+        for (int i = 0; i < binCount - 1; i++) {
+            leftBounds.expandToInclude(bins[i].bounds);
+            leftCount += entries[i];
+            if (leftCount == 0 || rightCounts[i + 1] == 0) continue;
+
+            float cost = leftBounds.surfaceArea() * leftCount + rightAreas[i + 1] * rightCounts[i + 1];
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = i;
+                best.leftBounds = leftBounds;
+                best.rightBounds = rightBoxes[i + 1];
+            }
+        }
+    }
+
+    // Bounds of the part of the triangle that lies between two planes perpendicular to the axis
+    static AABB ClipTriangle(const Triangle& triangle, int axis, float planeMin, float planeMax) {
+        AABB clipped = AABB::Empty();
+        const Vector3* vertices[3] = { &triangle.vertexA, &triangle.vertexB, &triangle.vertexC };
+
+        for (int i = 0; i < 3; i++) {
+            const Vector3& start = *vertices[i];
+            const Vector3& end = *vertices[(i + 1) % 3];
+            float startValue = AABB::axisValue(start, axis);
+            float endValue = AABB::axisValue(end, axis);
+
+            if (startValue >= planeMin && startValue <= planeMax) {
+                clipped.expandToInclude(start);
+            }
+
+            for (float plane : { planeMin, planeMax }) {
+                if ((startValue < plane && endValue > plane) || (startValue > plane && endValue < plane)) {
+                    Vector3 point = start + (end - start) * ((plane - startValue) / (endValue - startValue));
+                    if (axis == AxisX) point.x = plane;
+                    else if (axis == AxisY) point.y = plane;
+                    else point.z = plane;
+                    clipped.expandToInclude(point);
+                }
+            }
+        }
+
+        return clipped;
+    }
+
+    static inline float BinScale(const AABB& bounds, int axis, int binCount) {
+        float extent = AABB::axisValue(bounds.max, axis) - AABB::axisValue(bounds.min, axis);
+        return extent > 0 ? binCount / extent : 0;
+    }
+
+    static inline int BinOf(float value, float axisMin, float binScale, int binCount) {
+        return std::max(0, std::min(binCount - 1, (int)((value - axisMin) * binScale)));
+    }
+};
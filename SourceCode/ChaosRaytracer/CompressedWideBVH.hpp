@@ -0,0 +1,204 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+#include "Vector3.hpp"
+#include "WideBVH.hpp"
+
+// Children bounds are stored as 8 bit offsets on a per axis power of two grid that starts at the node origin,
+// the grid is rounded outwards so the decoded boxes always contain the exact ones
+template <int Width>
+struct alignas(16) CompressedWideBVHNode {
+    float originX;
+    float originY;
+    float originZ;
+    int8_t exponentX;
+    int8_t exponentY;
+    int8_t exponentZ;
+    uint8_t childCount;
+    uint8_t lowerX[Width];
+    uint8_t lowerY[Width];
+    uint8_t lowerZ[Width];
+    uint8_t upperX[Width];
+    uint8_t upperY[Width];
+    uint8_t upperZ[Width];
+    int child[Width];                // interior child: node index, leaf child: first entry in BVH::triangleIndices
+    uint16_t triangleCount[Width];   // 0 for interior children
+
+    CompressedWideBVHNode() : originX(0), originY(0), originZ(0), exponentX(0), exponentY(0), exponentZ(0), childCount(0) {
+        for (int i = 0; i < Width; i++) {
+            lowerX[i] = lowerY[i] = lowerZ[i] = 0;
+            upperX[i] = upperY[i] = upperZ[i] = 0;
+            child[i] = -1;
+            triangleCount[i] = 0;
+        }
+    }
+};
+
+// Builds 2^exponent directly from the float bits
+inline float ExponentToScale(int exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// Decodes four children of one axis, lower = origin + offset * scale
+inline void DecodeFourBounds(const uint8_t* lower, const uint8_t* upper, float origin, float scale, __m128& lowerBounds, __m128& upperBounds) {
+    int lowerBytes, upperBytes;
+    std::memcpy(&lowerBytes, lower, sizeof(int));
+    std::memcpy(&upperBytes, upper, sizeof(int));
+    __m128i zero = _mm_setzero_si128();
+    __m128i lowerInts = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lowerBytes), zero), zero);
+    __m128i upperInts = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(upperBytes), zero), zero);
+    __m128 originVector = _mm_set1_ps(origin);
+    __m128 scaleVector = _mm_set1_ps(scale);
+    lowerBounds = _mm_add_ps(originVector, _mm_mul_ps(_mm_cvtepi32_ps(lowerInts), scaleVector));
+    upperBounds = _mm_add_ps(originVector, _mm_mul_ps(_mm_cvtepi32_ps(upperInts), scaleVector));
+}
+
+// Passing the upper offsets as the lower ones for negative direction axes decodes the near and far planes directly
+template <int Width>
+inline int IntersectFourCompressedChildren(const CompressedWideBVHNode<Width>& node, int first, const Ray& ray, float tMax, float* entryDistances) {
+    __m128 nearX, farX, nearY, farY, nearZ, farZ;
+    DecodeFourBounds((ray.sign[0] ? node.upperX : node.lowerX) + first, (ray.sign[0] ? node.lowerX : node.upperX) + first, node.originX, ExponentToScale(node.exponentX), nearX, farX);
+    DecodeFourBounds((ray.sign[1] ? node.upperY : node.lowerY) + first, (ray.sign[1] ? node.lowerY : node.upperY) + first, node.originY, ExponentToScale(node.exponentY), nearY, farY);
+    DecodeFourBounds((ray.sign[2] ? node.upperZ : node.lowerZ) + first, (ray.sign[2] ? node.lowerZ : node.upperZ) + first, node.originZ, ExponentToScale(node.exponentZ), nearZ, farZ);
+
+    __m128 inverseX = _mm_set1_ps(ray.inverseDirection.x);
+    __m128 inverseY = _mm_set1_ps(ray.inverseDirection.y);
+    __m128 inverseZ = _mm_set1_ps(ray.inverseDirection.z);
+
+    __m128 tEntry = _mm_setzero_ps();
+    __m128 tExit = _mm_set1_ps(tMax);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearX, _mm_set1_ps(ray.origin.x)), inverseX), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farX, _mm_set1_ps(ray.origin.x)), inverseX), tExit);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearY, _mm_set1_ps(ray.origin.y)), inverseY), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farY, _mm_set1_ps(ray.origin.y)), inverseY), tExit);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearZ, _mm_set1_ps(ray.origin.z)), inverseZ), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farZ, _mm_set1_ps(ray.origin.z)), inverseZ), tExit);
+
+    _mm_storeu_ps(entryDistances, tEntry);
+    return _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit));
+}
+
+#if defined(__AVX2__)
+// Decodes eight children of one axis, lower = origin + offset * scale
+inline void DecodeEightBounds(const uint8_t* lower, const uint8_t* upper, float origin, float scale, __m256& lowerBounds, __m256& upperBounds) {
+    __m256 originVector = _mm256_set1_ps(origin);
+    __m256 scaleVector = _mm256_set1_ps(scale);
+    __m256 lowerOffsets = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)lower)));
+    __m256 upperOffsets = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)upper)));
+    lowerBounds = _mm256_fmadd_ps(lowerOffsets, scaleVector, originVector);
+    upperBounds = _mm256_fmadd_ps(upperOffsets, scaleVector, originVector);
+}
+
+inline int IntersectEightCompressedChildren(const CompressedWideBVHNode<8>& node, const Ray& ray, float tMax, float* entryDistances) {
+    __m256 nearX, farX, nearY, farY, nearZ, farZ;
+    DecodeEightBounds(ray.sign[0] ? node.upperX : node.lowerX, ray.sign[0] ? node.lowerX : node.upperX, node.originX, ExponentToScale(node.exponentX), nearX, farX);
+    DecodeEightBounds(ray.sign[1] ? node.upperY : node.lowerY, ray.sign[1] ? node.lowerY : node.upperY, node.originY, ExponentToScale(node.exponentY), nearY, farY);
+    DecodeEightBounds(ray.sign[2] ? node.upperZ : node.lowerZ, ray.sign[2] ? node.lowerZ : node.upperZ, node.originZ, ExponentToScale(node.exponentZ), nearZ, farZ);
+
+    __m256 inverseX = _mm256_set1_ps(ray.inverseDirection.x);
+    __m256 inverseY = _mm256_set1_ps(ray.inverseDirection.y);
+    __m256 inverseZ = _mm256_set1_ps(ray.inverseDirection.z);
+
+    __m256 tEntry = _mm256_setzero_ps();
+    __m256 tExit = _mm256_set1_ps(tMax);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearX, _mm256_set1_ps(ray.origin.x)), inverseX), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farX, _mm256_set1_ps(ray.origin.x)), inverseX), tExit);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearY, _mm256_set1_ps(ray.origin.y)), inverseY), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farY, _mm256_set1_ps(ray.origin.y)), inverseY), tExit);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(nearZ, _mm256_set1_ps(ray.origin.z)), inverseZ), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(farZ, _mm256_set1_ps(ray.origin.z)), inverseZ), tExit);
+
+    _mm256_storeu_ps(entryDistances, tEntry);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ));
+}
+#endif
+
+template <int Width>
+struct CompressedWideBVH {
+    static_assert(Width == 4 || Width == 8, "CompressedWideBVH supports 4 and 8 children per node");
+
+    typedef CompressedWideBVHNode<Width> Node;
+    static constexpr int WIDTH = Width;
+
+    std::vector<Node> nodes;
+
+    // Quantizes the collapsed tree node by node, so child indices and leaves stay the same as in the uncompressed tree
+    void build(const BVH& binary) {
+        nodes.clear();
+        if (binary.nodes.empty()) return;
+
+        WideBVH<Width> wide;
+        wide.build(binary);
+        nodes.resize(wide.nodes.size());
+        for (size_t i = 0; i < wide.nodes.size(); i++) {
+            compressNode(wide.nodes[i], nodes[i]);
+        }
+    }
+
+    inline int intersectChildren(const Node& node, const Ray& ray, float tMax, float* entryDistances) const {
+        int mask;
+        if constexpr (Width == 4) {
+            mask = IntersectFourCompressedChildren(node, 0, ray, tMax, entryDistances);
+        }
+        else {
+#if defined(__AVX2__)
+            mask = IntersectEightCompressedChildren(node, ray, tMax, entryDistances);
+#else
+            mask = IntersectFourCompressedChildren(node, 0, ray, tMax, entryDistances) |
+                (IntersectFourCompressedChildren(node, 4, ray, tMax, entryDistances + 4) << 4);
+#endif
+        }
+        return mask & ((1 << node.childCount) - 1);
+    }
+
+private:
+    static void compressNode(const WideBVHNode<Width>& wideNode, Node& node) {
+        node.childCount = (uint8_t)wideNode.childCount;
+        for (int i = 0; i < wideNode.childCount; i++) {
+            node.child[i] = wideNode.child[i];
+            node.triangleCount[i] = wideNode.triangleCount[i];
+        }
+
+        compressAxis(wideNode.minX, wideNode.maxX, wideNode.childCount, node.originX, node.exponentX, node.lowerX, node.upperX);
+        compressAxis(wideNode.minY, wideNode.maxY, wideNode.childCount, node.originY, node.exponentY, node.lowerY, node.upperY);
+        compressAxis(wideNode.minZ, wideNode.maxZ, wideNode.childCount, node.originZ, node.exponentZ, node.lowerZ, node.upperZ);
+    }
+
+    static void compressAxis(const float* minimums, const float* maximums, int childCount, float& origin, int8_t& exponent, uint8_t* lower, uint8_t* upper) {
+        float nodeMin = std::numeric_limits<float>::infinity();
+        float nodeMax = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < childCount; i++) {
+            nodeMin = std::min(nodeMin, minimums[i]);
+            nodeMax = std::max(nodeMax, maximums[i]);
+        }
+
+        // Smallest power of two step for which 255 steps from the origin still reach the node maximum
+        origin = nodeMin;
+        int scaleExponent = nodeMax > nodeMin ? std::max(-126, (int)std::ceil(std::log2((nodeMax - nodeMin) / 255.0f))) : -126;
+        while (scaleExponent < 127 && origin + 255.0f * ExponentToScale(scaleExponent) < nodeMax) {
+            scaleExponent++;
+        }
+        exponent = (int8_t)std::min(scaleExponent, 127);
+        float scale = ExponentToScale(exponent);
+
+        for (int i = 0; i < childCount; i++) {
+            int lowerOffset = std::max(0, std::min(255, (int)std::floor((minimums[i] - origin) / scale)));
+            int upperOffset = std::max(0, std::min(255, (int)std::ceil((maximums[i] - origin) / scale)));
+
+            // Rounding of the decoding may still cut a little off the exact box, step outwards until it is covered
+            while (lowerOffset > 0 && origin + lowerOffset * scale > minimums[i]) lowerOffset--;
+            while (upperOffset < 255 && origin + upperOffset * scale < maximums[i]) upperOffset++;
+
+            lower[i] = (uint8_t)lowerOffset;
+            upper[i] = (uint8_t)upperOffset;
+        }
+    }
+};
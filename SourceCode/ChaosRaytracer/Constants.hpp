@@ -9,8 +9,45 @@ const int MAXIMUM_RAY_BOUNCES_COUNT = 6;
 const float LIGHT_INTENSITY_CORRECTION = 1 / 8.0f / 3.0f;
 const std::string SCENES_FOLDER = "./scenes/15";
 const int THREADS_TO_USE = std::max(1, (int)std::thread::hardware_concurrency() - 1);
-const int MAX_KDTREE_DEPTH = 16;
+const int MEDIAN_SPLIT_MAX_DEPTH = 16;
 const int MIN_TRIANGLES_IN_NODE = 4;
+const int SAH_BIN_COUNT = 16;
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECTION_COST = 1.0f;
+const int SAH_MAX_TRIANGLES_IN_LEAF = 64;
+const int ACC_TREE_LEAF_SIZE = 0; // 0 keeps MIN_TRIANGLES_IN_NODE for median splits and SAH_MAX_TRIANGLES_IN_LEAF for the SAH builders
+const int BVH_MAX_DEPTH = 64;
+const int SBVH_BIN_COUNT = 16;
+const float SBVH_DUPLICATION_BUDGET = 0.3f;
+const float SBVH_OVERLAP_THRESHOLD = 1e-5f;
+const int KD_TREE_MAX_DEPTH = 64;
+const int KD_TREE_MAX_TRIANGLES_IN_LEAF = 1;
+const float KD_TREE_TRAVERSAL_COST = 1.0f;
+const float KD_TREE_INTERSECTION_COST = 8.0f;
+const float KD_TREE_EMPTY_BONUS = 0.5f;
+const float GRID_TOP_LEVEL_DENSITY = 1 / 16.0f; // cells per triangle
+const float GRID_SUB_GRID_DENSITY = 3.0f;       // cells per triangle of the subdivided top level cell
+const int GRID_SUB_GRID_MIN_TRIANGLES = 4;
+const int GRID_MAX_RESOLUTION = 256;
+const float GRID_MIN_RELATIVE_EXTENT = 1e-3f;
+const float GRID_CELL_PADDING = 1e-4f;
+const float REFIT_REBUILD_THRESHOLD = 1.5f;
+const int ACC_TREE_OPTIMIZATION_PASSES = 0;
+const int TREELET_SIZE = 7;
+const bool ACC_TREE_CACHE_ON = true;
+const std::string ACC_TREE_CACHE_EXTENSION = ".bvhcache";
+const int BUILD_ARENA_MAX_OVERSIZE = 4; // the build scratch is released once it could hold this many times the largest build of a loaded scene
+const int PARALLEL_BUILD_MIN_TRIANGLES = 1 << 14;
+const int PARALLEL_BINNING_MIN_TRIANGLES = 1 << 16;
+const int PARALLEL_TREELET_MIN_ROOTS = 64;
+const int PARALLEL_GRID_MIN_TRIANGLES = 1 << 14;
+const int PARALLEL_GRID_MIN_SUB_GRIDS = 256;
+const int ACC_TREE_TUNING_LEAF_SIZES[] = { 1, 2, 4, 8, 16, 64 };
+const int ACC_TREE_TUNING_SAMPLE_DIVISOR = 4;
+const int ACC_TREE_TUNING_RUNS = 3;
+const bool PACKET_TRACING_ON = true;
+const int PACKET_MIN_ACTIVE_RAYS = 4;
+const bool RAY_SORTING_ON = false;
 
 // Constants
 const int MAX_COLOR_COMPONENT = 255;
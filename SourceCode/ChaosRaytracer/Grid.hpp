@@ -0,0 +1,286 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "Vector3.hpp"
+#include "Ray.hpp"
+#include "Triangle.hpp"
+#include "AABB.hpp"
+#include "Parallel.hpp"
+
+// Leaf cells hold a range of Grid::triangleIndices, a cell with a sub grid holds the index of its level instead
+struct GridCell {
+    int first;
+    int count; // -1 when first is a level index
+
+    inline bool hasSubGrid() const { return count < 0; }
+};
+
+// A uniform grid over a box, its cells are stored x fastest from firstCell on
+struct GridLevel {
+    float min[3];
+    float cellSize[3];
+    float inverseCellSize[3];
+    int resolution[3];
+    int firstCell;
+
+    // About cellsPerTriangle * triangleCount roughly cubic cells, flat boxes get a single cell along their flat axes
+    void setup(const AABB& bounds, float cellsPerTriangle, int triangleCount, int levelFirstCell) {
+        Vector3 extent = bounds.max - bounds.min;
+        float extents[3] = { extent.x, extent.y, extent.z };
+        float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+        float volume = std::max(extent.x, maxExtent * GRID_MIN_RELATIVE_EXTENT) * std::max(extent.y, maxExtent * GRID_MIN_RELATIVE_EXTENT) * std::max(extent.z, maxExtent * GRID_MIN_RELATIVE_EXTENT);
+        float cellsPerUnit = volume > 0 ? std::cbrt(cellsPerTriangle * triangleCount / volume) : 0.0f;
+
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = AABB::axisValue(bounds.min, axis);
+            resolution[axis] = std::clamp((int)std::round(extents[axis] * cellsPerUnit), 1, GRID_MAX_RESOLUTION);
+            cellSize[axis] = extents[axis] / resolution[axis];
+            inverseCellSize[axis] = cellSize[axis] > 0 ? 1.0f / cellSize[axis] : 0.0f;
+        }
+        firstCell = levelFirstCell;
+    }
+
+    inline int cellCount() const { return resolution[0] * resolution[1] * resolution[2]; }
+
+    inline int cellIndex(int x, int y, int z) const { return firstCell + (z * resolution[1] + y) * resolution[0] + x; }
+
+    inline int axisCell(float position, int axis) const {
+        return std::clamp((int)std::floor((position - min[axis]) * inverseCellSize[axis]), 0, resolution[axis] - 1);
+    }
+
+    inline AABB cellBounds(int x, int y, int z) const {
+        return AABB(
+            Vector3(min[0] + x * cellSize[0], min[1] + y * cellSize[1], min[2] + z * cellSize[2]),
+            Vector3(min[0] + (x + 1) * cellSize[0], min[1] + (y + 1) * cellSize[1], min[2] + (z + 1) * cellSize[2])
+        );
+    }
+};
+
+// Two level uniform grid, rebuilt from scratch in linear time instead of refitted, for geometry that changes every frame.
+// Top level cells holding more than GRID_SUB_GRID_MIN_TRIANGLES triangles get a finer grid of their own, so dense
+// regions do not end up in a few overfull cells. Cells reference every triangle whose plane passes through them
+struct Grid {
+    std::vector<GridLevel> levels; // the top level first
+    std::vector<GridCell> cells;
+    std::vector<int> triangleIndices; // indexes the mesh triangles, a triangle is referenced by every cell it overlaps
+    AABB bounds;
+
+    // Counting sort of the cell references in two passes per level, the chunks count and fill their own slots
+    void build(const std::vector<Triangle>& triangles) {
+        levels.clear();
+        cells.clear();
+        triangleIndices.clear();
+        bounds = AABB::Empty();
+        if (triangles.empty()) return;
+
+        int triangleCount = (int)triangles.size();
+        std::vector<AABB> triangleBounds(triangleCount);
+        std::vector<AABB> chunkBounds(THREADS_TO_USE);
+        ParallelChunks(0, triangleCount, [&](int chunkIndex, int chunkBegin, int chunkEnd) {
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                triangleBounds[i].expandToInclude(triangles[i].vertexA);
+                triangleBounds[i].expandToInclude(triangles[i].vertexB);
+                triangleBounds[i].expandToInclude(triangles[i].vertexC);
+                chunkBounds[chunkIndex].expandToInclude(triangleBounds[i]);
+            }
+        }, PARALLEL_GRID_MIN_TRIANGLES);
+        for (const AABB& chunkBound : chunkBounds) {
+            bounds.expandToInclude(chunkBound);
+        }
+
+        levels.emplace_back();
+        levels[0].setup(bounds, GRID_TOP_LEVEL_DENSITY, triangleCount, 0);
+        int topCellCount = levels[0].cellCount();
+
+        // Top level references, per chunk counts keep the order of the triangles within each cell
+        int chunkCount = triangleCount >= PARALLEL_GRID_MIN_TRIANGLES ? THREADS_TO_USE : 1;
+        std::vector<std::vector<int>> chunkCellCounts(chunkCount, std::vector<int>(topCellCount, 0));
+        ParallelChunks(0, triangleCount, [&](int chunkIndex, int chunkBegin, int chunkEnd) {
+            std::vector<int>& cellCounts = chunkCellCounts[chunkIndex];
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                ForEachOverlappedCell(levels[0], triangles[i], triangleBounds[i], [&](int cell) { cellCounts[cell]++; });
+            }
+        }, PARALLEL_GRID_MIN_TRIANGLES);
+
+        std::vector<int> topFirst(topCellCount);
+        std::vector<int> topCount(topCellCount);
+        int topReferences = 0;
+        for (int cell = 0; cell < topCellCount; cell++) {
+            topFirst[cell] = topReferences;
+            for (int chunk = 0; chunk < chunkCount; chunk++) {
+                int count = chunkCellCounts[chunk][cell];
+                chunkCellCounts[chunk][cell] = topReferences;
+                topReferences += count;
+            }
+            topCount[cell] = topReferences - topFirst[cell];
+        }
+
+        std::vector<int> topTriangles(topReferences);
+        ParallelChunks(0, triangleCount, [&](int chunkIndex, int chunkBegin, int chunkEnd) {
+            std::vector<int>& cellCursors = chunkCellCounts[chunkIndex];
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                ForEachOverlappedCell(levels[0], triangles[i], triangleBounds[i], [&](int cell) { topTriangles[cellCursors[cell]++] = i; });
+            }
+        }, PARALLEL_GRID_MIN_TRIANGLES);
+        std::vector<std::vector<int>>().swap(chunkCellCounts);
+
+        // Dense top cells get a sub grid, its cells follow the top level ones
+        cells.resize(topCellCount, { 0, 0 });
+        std::vector<int> subdividedCells;
+        for (int z = 0; z < levels[0].resolution[2]; z++) {
+            for (int y = 0; y < levels[0].resolution[1]; y++) {
+                for (int x = 0; x < levels[0].resolution[0]; x++) {
+                    int cell = levels[0].cellIndex(x, y, z);
+                    if (topCount[cell] <= GRID_SUB_GRID_MIN_TRIANGLES) {
+                        cells[cell] = { 0, topCount[cell] };
+                        continue;
+                    }
+
+                    GridLevel subGrid;
+                    subGrid.setup(levels[0].cellBounds(x, y, z), GRID_SUB_GRID_DENSITY, topCount[cell], (int)cells.size());
+                    cells[cell] = { (int)levels.size(), -1 };
+                    cells.resize(cells.size() + subGrid.cellCount(), { 0, 0 });
+                    levels.push_back(subGrid);
+                    subdividedCells.push_back(cell);
+                }
+            }
+        }
+
+        // Sub grid references, every sub grid is counted and filled by one chunk so they need no per chunk counts
+        ParallelChunks(0, (int)subdividedCells.size(), [&](int, int chunkBegin, int chunkEnd) {
+            for (int i = chunkBegin; i < chunkEnd; i++) {
+                int cell = subdividedCells[i];
+                const GridLevel& subGrid = levels[cells[cell].first];
+                for (int reference = topFirst[cell]; reference < topFirst[cell] + topCount[cell]; reference++) {
+                    int triangle = topTriangles[reference];
+                    ForEachOverlappedCell(subGrid, triangles[triangle], triangleBounds[triangle], [&](int subCell) { cells[subCell].count++; });
+                }
+            }
+        }, PARALLEL_GRID_MIN_SUB_GRIDS);
+
+        int references = 0;
+        for (GridCell& cell : cells) {
+            if (cell.hasSubGrid()) continue;
+            cell.first = references;
+            references += cell.count;
+        }
+
+        triangleIndices.resize(references);
+        std::vector<int> cellCursors(cells.size());
+        for (size_t cell = 0; cell < cells.size(); cell++) {
+            cellCursors[cell] = cells[cell].first;
+        }
+        ParallelChunks(0, topCellCount, [&](int, int chunkBegin, int chunkEnd) {
+            for (int cell = chunkBegin; cell < chunkEnd; cell++) {
+                if (!cells[cell].hasSubGrid()) {
+                    std::copy(topTriangles.begin() + topFirst[cell], topTriangles.begin() + topFirst[cell] + topCount[cell], triangleIndices.begin() + cells[cell].first);
+                    continue;
+                }
+
+                const GridLevel& subGrid = levels[cells[cell].first];
+                for (int reference = topFirst[cell]; reference < topFirst[cell] + topCount[cell]; reference++) {
+                    int triangle = topTriangles[reference];
+                    ForEachOverlappedCell(subGrid, triangles[triangle], triangleBounds[triangle], [&](int subCell) { triangleIndices[cellCursors[subCell]++] = triangle; });
+                }
+            }
+        }, PARALLEL_GRID_MIN_SUB_GRIDS);
+    }
+
+    // 3D-DDA over the cells of a level that the ray passes in [entryDistance, exitDistance], in order along the ray.
+    // visit(cell, cellEntry, cellExit) returns true to stop the walk, walk then returns true as well
+    template <typename Visit>
+    bool walk(int levelIndex, const Ray& ray, float entryDistance, float exitDistance, Visit visit) const {
+        const GridLevel& level = levels[levelIndex];
+        Vector3 entryPoint = ray.origin + ray.direction * entryDistance;
+
+        int cell[3];
+        int step[3];
+        int outside[3];
+        float nextCrossing[3];
+        float crossingDelta[3];
+        for (int axis = 0; axis < 3; axis++) {
+            float origin = AABB::axisValue(ray.origin, axis);
+            float direction = AABB::axisValue(ray.direction, axis);
+            float inverseDirection = AABB::axisValue(ray.inverseDirection, axis);
+            cell[axis] = level.axisCell(AABB::axisValue(entryPoint, axis), axis);
+
+            if (direction > 0) {
+                step[axis] = 1;
+                outside[axis] = level.resolution[axis];
+                nextCrossing[axis] = (level.min[axis] + (cell[axis] + 1) * level.cellSize[axis] - origin) * inverseDirection;
+                crossingDelta[axis] = level.cellSize[axis] * inverseDirection;
+            }
+            else if (direction < 0) {
+                step[axis] = -1;
+                outside[axis] = -1;
+                nextCrossing[axis] = (level.min[axis] + cell[axis] * level.cellSize[axis] - origin) * inverseDirection;
+                crossingDelta[axis] = -level.cellSize[axis] * inverseDirection;
+            }
+            else {
+                step[axis] = 0;
+                outside[axis] = -1;
+                nextCrossing[axis] = std::numeric_limits<float>::infinity();
+                crossingDelta[axis] = 0.0f;
+            }
+        }
+
+        float cellEntry = entryDistance;
+        while (true) {
+            int axis = nextCrossing[0] < nextCrossing[1] ? (nextCrossing[0] < nextCrossing[2] ? 0 : 2) : (nextCrossing[1] < nextCrossing[2] ? 1 : 2);
+            float cellExit = std::min(nextCrossing[axis], exitDistance);
+            if (visit(cells[level.cellIndex(cell[0], cell[1], cell[2])], cellEntry, cellExit)) {
+                return true;
+            }
+
+            if (nextCrossing[axis] >= exitDistance) {
+                return false;
+            }
+            cell[axis] += step[axis];
+            if (cell[axis] == outside[axis]) {
+                return false;
+            }
+            cellEntry = nextCrossing[axis];
+            nextCrossing[axis] += crossingDelta[axis];
+        }
+    }
+
+private:
+    // Cells of the triangle's bounding box that its plane passes through, the boxes are padded by GRID_CELL_PADDING of a
+    // cell so a triangle touching a cell face is in the cells on both sides despite rounding
+    template <typename Function>
+    static void ForEachOverlappedCell(const GridLevel& level, const Triangle& triangle, const AABB& triangleBound, Function function) {
+        int lower[3];
+        int upper[3];
+        for (int axis = 0; axis < 3; axis++) {
+            float padding = GRID_CELL_PADDING * level.cellSize[axis];
+            lower[axis] = level.axisCell(AABB::axisValue(triangleBound.min, axis) - padding, axis);
+            upper[axis] = level.axisCell(AABB::axisValue(triangleBound.max, axis) + padding, axis);
+        }
+
+        Vector3 normal = (triangle.vertexB - triangle.vertexA).cross(triangle.vertexC - triangle.vertexA);
+        float planeOffset = normal.dot(triangle.vertexA);
+        Vector3 padding = Vector3(level.cellSize[0], level.cellSize[1], level.cellSize[2]) * GRID_CELL_PADDING;
+        bool single = lower[0] == upper[0] && lower[1] == upper[1] && lower[2] == upper[2];
+
+        for (int z = lower[2]; z <= upper[2]; z++) {
+            for (int y = lower[1]; y <= upper[1]; y++) {
+                for (int x = lower[0]; x <= upper[0]; x++) {
+                    if (single || PlaneOverlapsBox(normal, planeOffset, level.cellBounds(x, y, z), padding)) {
+                        function(level.cellIndex(x, y, z));
+                    }
+                }
+            }
+        }
+    }
+
+    // The box corners furthest along and against the normal lie on different sides of the plane or on it
+    static bool PlaneOverlapsBox(const Vector3& normal, float planeOffset, const AABB& box, const Vector3& padding) {
+        Vector3 center = box.center();
+        Vector3 halfExtent = (box.max - box.min) * 0.5f + padding;
+        float radius = halfExtent.x * std::abs(normal.x) + halfExtent.y * std::abs(normal.y) + halfExtent.z * std::abs(normal.z);
+        return std::abs(normal.dot(center) - planeOffset) <= radius;
+    }
+};
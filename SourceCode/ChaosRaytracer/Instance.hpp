@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Vector3.hpp"
+#include "Matrix3x3.hpp"
+#include "AABB.hpp"
+
+// Placement of a shared mesh, worldPoint = transform * objectPoint + position
+struct Instance {
+	int meshIndex;
+	Matrix3x3 transform;
+	Matrix3x3 inverseTransform;
+	Matrix3x3 normalTransform;
+	Vector3 position;
+	AABB bounds;
+
+	Instance(int _meshIndex, const Matrix3x3& _transform, const Vector3& _position, const AABB& meshBounds)
+		: meshIndex(_meshIndex), transform(_transform), inverseTransform(_transform.inverse()), normalTransform(_transform.inverse().transpose()), position(_position) {
+		bounds = AABB::Empty();
+		for (int corner = 0; corner < 8; corner++) {
+			Vector3 point = Vector3(
+				corner & 1 ? meshBounds.max.x : meshBounds.min.x,
+				corner & 2 ? meshBounds.max.y : meshBounds.min.y,
+				corner & 4 ? meshBounds.max.z : meshBounds.min.z
+			);
+			bounds.expandToInclude(transform * point + position);
+		}
+	}
+
+	// The direction is not renormalized so distances along the object space ray match the world space ones
+	inline Vector3 toObjectDirection(const Vector3& direction) const { return inverseTransform * direction; }
+
+	inline Vector3 toObjectPoint(const Vector3& point) const { return inverseTransform * (point - position); }
+
+	inline Vector3 toWorldNormal(const Vector3& normal) const { return (normalTransform * normal).normalize(); }
+};
@@ -3,6 +3,27 @@
 
 enum IntersectionType { Miss, Hit };
 
+// What traversal carries for the closest hit found so far, a few words per ray.
+// The shading attributes of the final hit are evaluated into an Intersection once traversal is done
+struct RayHit {
+	float distance;
+	int triangleIndex; // in the mesh that was hit, -1 for a miss
+	int instanceIndex; // -1 for the scene objects
+	float u;
+	float v;
+
+	RayHit() : distance(std::numeric_limits<float>::infinity()), triangleIndex(-1), instanceIndex(-1), u(0), v(0) {}
+
+	inline bool isHit() const { return triangleIndex != -1; }
+
+	inline void set(int _triangleIndex, float _distance, float _u, float _v) {
+		triangleIndex = _triangleIndex;
+		distance = _distance;
+		u = _u;
+		v = _v;
+	}
+};
+
 struct Intersection {
 	int materialIndex;
 	float distance;
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#include "Vector3.hpp"
+#include "Triangle.hpp"
+#include "AABB.hpp"
+
+// The child below the split plane directly follows its parent
+struct KDTreeNode {
+    union {
+        float split;       // interior
+        int firstTriangle; // leaf: first entry in KDTree::triangleIndices
+    };
+    uint32_t flags;        // low 2 bits: split axis or 3 for leaves, the rest: index of the child above the plane or the leaf's triangle count
+
+    inline bool isLeaf() const { return (flags & 3) == 3; }
+    inline int axis() const { return flags & 3; }
+    inline int aboveChild() const { return flags >> 2; }
+    inline int triangleCount() const { return flags >> 2; }
+};
+
+static_assert(sizeof(KDTreeNode) == 8, "KDTreeNode is expected to be 8 bytes");
+
+// Space is cut by SAH placed split planes, so unlike BVH nodes the cells of the children never overlap and are
+// visited strictly front to back. Triangles that cross a plane are referenced from both sides.
+// The empty space bonus makes planes that cut off empty space cheaper, so empty cells are split off early
+struct KDTree {
+    std::vector<KDTreeNode> nodes;
+    std::vector<int> triangleIndices; // leaves refer to ranges of this array, which indexes the mesh triangles
+    AABB bounds;
+
+    void build(const std::vector<Triangle>& triangles) {
+        nodes.clear();
+        triangleIndices.clear();
+        bounds = AABB::Empty();
+        if (triangles.empty()) return;
+
+        std::vector<AABB> triangleBounds(triangles.size());
+        for (size_t i = 0; i < triangles.size(); i++) {
+            triangleBounds[i].expandToInclude(triangles[i].vertexA);
+            triangleBounds[i].expandToInclude(triangles[i].vertexB);
+            triangleBounds[i].expandToInclude(triangles[i].vertexC);
+            bounds.expandToInclude(triangleBounds[i]);
+        }
+
+        std::vector<int> allTriangles(triangles.size());
+        std::iota(allTriangles.begin(), allTriangles.end(), 0);
+        int maxDepth = std::min(KD_TREE_MAX_DEPTH, (int)std::round(8 + 1.3f * std::log2((float)triangles.size())));
+        buildNode(triangleBounds, allTriangles, bounds, maxDepth, 0);
+    }
+
+private:
+    struct BoundEdge {
+        float position;
+        int triangle;
+        bool start;
+
+        // Starts come before ends at the same position, so a plane there counts the triangle above it only
+        bool operator<(const BoundEdge& other) const {
+            return position == other.position ? start > other.start : position < other.position;
+        }
+    };
+
+    static void SetAxisValue(Vector3& vector, int axis, float value) {
+        if (axis == AxisX) vector.x = value;
+        else if (axis == AxisY) vector.y = value;
+        else vector.z = value;
+    }
+
+    void makeLeaf(int nodeIndex, const std::vector<int>& nodeTriangles) {
+        nodes[nodeIndex].firstTriangle = (int)triangleIndices.size();
+        nodes[nodeIndex].flags = 3 | ((uint32_t)nodeTriangles.size() << 2);
+        triangleIndices.insert(triangleIndices.end(), nodeTriangles.begin(), nodeTriangles.end());
+    }
+
+    // badRefines counts the splits on the way down that were more expensive than a leaf, a few of them are allowed
+    // since they can lead to good splits further down
+    void buildNode(const std::vector<AABB>& triangleBounds, std::vector<int>& nodeTriangles, const AABB& nodeBounds, int depth, int badRefines) {
+        int nodeIndex = (int)nodes.size();
+        nodes.emplace_back();
+
+        int count = (int)nodeTriangles.size();
+        if (count <= KD_TREE_MAX_TRIANGLES_IN_LEAF || depth == 0) {
+            makeLeaf(nodeIndex, nodeTriangles);
+            return;
+        }
+
+        Vector3 extent = nodeBounds.max - nodeBounds.min;
+        float inverseSurfaceArea = 1.0f / nodeBounds.surfaceArea();
+        float leafCost = KD_TREE_INTERSECTION_COST * count;
+
+        // Exact sweep over the triangle bounds of one axis, the other two axes are tried when it has no usable plane
+        int axis = extent.x > extent.y && extent.x > extent.z ? AxisX : (extent.y > extent.z ? AxisY : AxisZ);
+        int bestAxis = -1;
+        int bestOffset = -1;
+        float bestCost = std::numeric_limits<float>::infinity();
+        std::vector<BoundEdge> edges(2 * count);
+        for (int retries = 0; retries < 3 && bestAxis == -1; retries++, axis = (axis + 1) % 3) {
+            for (int i = 0; i < count; i++) {
+                const AABB& triangleBound = triangleBounds[nodeTriangles[i]];
+                edges[2 * i] = { AABB::axisValue(triangleBound.min, axis), nodeTriangles[i], true };
+                edges[2 * i + 1] = { AABB::axisValue(triangleBound.max, axis), nodeTriangles[i], false };
+            }
+            std::sort(edges.begin(), edges.end());
+
+            float axisMin = AABB::axisValue(nodeBounds.min, axis);
+            float axisMax = AABB::axisValue(nodeBounds.max, axis);
+            float otherExtentA = AABB::axisValue(extent, (axis + 1) % 3);
+            float otherExtentB = AABB::axisValue(extent, (axis + 2) % 3);
+            int belowCount = 0;
+            int aboveCount = count;
+            for (int i = 0; i < 2 * count; i++) {
+                if (!edges[i].start) aboveCount--;
+
+                float position = edges[i].position;
+                if (position > axisMin && position < axisMax) {
+                    float belowProbability = 2 * (otherExtentA * otherExtentB + (position - axisMin) * (otherExtentA + otherExtentB)) * inverseSurfaceArea;
+                    float aboveProbability = 2 * (otherExtentA * otherExtentB + (axisMax - position) * (otherExtentA + otherExtentB)) * inverseSurfaceArea;
+                    float emptyBonus = (belowCount == 0 || aboveCount == 0) ? KD_TREE_EMPTY_BONUS : 0.0f;
+                    float cost = KD_TREE_TRAVERSAL_COST + KD_TREE_INTERSECTION_COST * (1 - emptyBonus) * (belowProbability * belowCount + aboveProbability * aboveCount);
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestOffset = i;
+                    }
+                }
+
+                if (edges[i].start) belowCount++;
+            }
+        }
+
+        if (bestCost > leafCost) badRefines++;
+        if (bestAxis == -1 || (bestCost > 4 * leafCost && count < 16) || badRefines == 3) {
+            makeLeaf(nodeIndex, nodeTriangles);
+            return;
+        }
+
+        // edges still hold the sweep of bestAxis, the retries stop as soon as an axis has a plane
+        std::vector<int> belowTriangles;
+        std::vector<int> aboveTriangles;
+        for (int i = 0; i < bestOffset; i++) {
+            if (edges[i].start) belowTriangles.push_back(edges[i].triangle);
+        }
+        for (int i = bestOffset + 1; i < 2 * count; i++) {
+            if (!edges[i].start) aboveTriangles.push_back(edges[i].triangle);
+        }
+        float split = edges[bestOffset].position;
+        std::vector<BoundEdge>().swap(edges);
+        std::vector<int>().swap(nodeTriangles);
+
+        AABB belowBounds = nodeBounds;
+        AABB aboveBounds = nodeBounds;
+        SetAxisValue(belowBounds.max, bestAxis, split);
+        SetAxisValue(aboveBounds.min, bestAxis, split);
+
+        buildNode(triangleBounds, belowTriangles, belowBounds, depth - 1, badRefines);
+        int aboveChild = (int)nodes.size();
+        buildNode(triangleBounds, aboveTriangles, aboveBounds, depth - 1, badRefines);
+
+        nodes[nodeIndex].split = split;
+        nodes[nodeIndex].flags = (uint32_t)bestAxis | ((uint32_t)aboveChild << 2);
+    }
+};
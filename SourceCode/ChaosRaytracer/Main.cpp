@@ -34,6 +34,29 @@ int main() {
     /**/
 
 
+
+    /*/
+    scene.loadScene(SCENES_FOLDER + "/scene1.crtscene");
+    std::vector<Vector3> restVertices = scene.objectVertices(0);
+    for (int frame = 0; frame < 24; frame++) {
+        std::vector<Vector3> vertices = restVertices;
+        for (auto& vertex : vertices) {
+            vertex.y += 0.1f * sin(vertex.x * 4 + frame * 2 * M_PI / 24);
+        }
+        scene.updateObjectVertices(0, vertices);
+        scene.refitAccTree();
+        scene.renderFrame(frame);
+    }
+    /**/
+
+
+
+    /*/
+    scene.loadScene(SCENES_FOLDER + "/scene1.crtscene");
+    scene.tuneAccTree();
+    /**/
+
+
     
     auto stop = std::chrono::high_resolution_clock::now();
     std::cout << "Done in: " << (stop - start) / 1ms << " ms ~ " << (stop - start) / 1s << " s" << std::endl;
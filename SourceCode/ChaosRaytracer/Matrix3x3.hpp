@@ -25,6 +25,35 @@ struct Matrix3x3 {
 		);
 	}
 
+	float determinant() const {
+		return data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1])
+			- data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0])
+			+ data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
+	}
+
+	Matrix3x3 transpose() const {
+		return Matrix3x3(
+			data[0][0], data[1][0], data[2][0],
+			data[0][1], data[1][1], data[2][1],
+			data[0][2], data[1][2], data[2][2]
+		);
+	}
+
+	Matrix3x3 inverse() const {
+		float inverseDeterminant = 1.0f / determinant();
+		return Matrix3x3(
+			(data[1][1] * data[2][2] - data[1][2] * data[2][1]) * inverseDeterminant,
+			(data[0][2] * data[2][1] - data[0][1] * data[2][2]) * inverseDeterminant,
+			(data[0][1] * data[1][2] - data[0][2] * data[1][1]) * inverseDeterminant,
+			(data[1][2] * data[2][0] - data[1][0] * data[2][2]) * inverseDeterminant,
+			(data[0][0] * data[2][2] - data[0][2] * data[2][0]) * inverseDeterminant,
+			(data[0][2] * data[1][0] - data[0][0] * data[1][2]) * inverseDeterminant,
+			(data[1][0] * data[2][1] - data[1][1] * data[2][0]) * inverseDeterminant,
+			(data[0][1] * data[2][0] - data[0][0] * data[2][1]) * inverseDeterminant,
+			(data[0][0] * data[1][1] - data[0][1] * data[1][0]) * inverseDeterminant
+		);
+	}
+
 	void setRotationX(float angle) {
 		float c = cos(angle);
 		float s = sin(angle);
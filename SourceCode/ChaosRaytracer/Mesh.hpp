@@ -0,0 +1,252 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "Triangle.hpp"
+#include "BVH.hpp"
+#include "WideBVH.hpp"
+#include "CompressedWideBVH.hpp"
+#include "KDTree.hpp"
+#include "Grid.hpp"
+#include "TrianglePacket.hpp"
+
+// Indexed triangles over shared vertex buffers together with their own acceleration trees, can be shared by any number of instances
+struct Mesh {
+    std::vector<Vector3> vertices;
+    std::vector<Vector3> vertexNormals;            // for smooth shading, flat shaded materials use the face normal instead
+    std::vector<Vector3> vertexUVs;
+    std::vector<IndexedTriangle> indexedTriangles; // in BVH leaf order with the BVH layouts, one per slot of accTree.triangleIndices, which maps it to its source triangle
+    std::vector<TriangleRecord> triangleRecords;   // intersection setup of the indexed triangles, in the same order, only for the kd-tree and the grid
+    std::vector<TrianglePacket> trianglePackets;   // the triangles of every BVH leaf, a leaf's last packet is padded
+    std::vector<int> leafFirstPacket;              // first packet of the leaf that starts at each triangle slot, -1 for other slots
+    BVH accTree;
+    WideBVH<4> accTree4;
+    WideBVH<8> accTree8;
+    CompressedWideBVH<4> compressedAccTree4;
+    CompressedWideBVH<8> compressedAccTree8;
+    KDTree kdTree;
+    Grid grid;
+    bool leafOrder = false;       // whether indexedTriangles are in leaf order
+    int sourceTriangleCount = 0;  // indexed triangles before they were put in leaf order
+
+    // Source triangles, in leaf order the slots duplicated by spatial splits are not counted
+    inline int triangleCount() const { return leafOrder ? sourceTriangleCount : (int)indexedTriangles.size(); }
+
+    // Takes a source index before the tree is built and a leaf slot once the triangles are in leaf order, like the hits do
+    inline Triangle triangle(int triangleIndex) const {
+        return triangle(indexedTriangles[triangleIndex]);
+    }
+
+    inline Triangle triangle(const IndexedTriangle& indexed) const {
+        return Triangle(vertices[indexed.vertexA], vertices[indexed.vertexB], vertices[indexed.vertexC]);
+    }
+
+    // Positions of all triangles in source order for the tree builders, only kept while a tree is built
+    std::vector<Triangle> gatherTriangles() const {
+        std::vector<Triangle> triangles;
+        triangles.reserve(triangleCount());
+        if (!leafOrder) {
+            for (int i = 0; i < triangleCount(); i++) {
+                triangles.push_back(triangle(i));
+            }
+            return triangles;
+        }
+
+        std::vector<int> slots = sourceSlots(0, sourceTriangleCount);
+        for (int slot : slots) {
+            triangles.push_back(triangle(slot));
+        }
+        return triangles;
+    }
+
+    // Empties the mesh before it is loaded again, keeping the allocations
+    void clearGeometry() {
+        vertices.clear();
+        vertexNormals.clear();
+        vertexUVs.clear();
+        indexedTriangles.clear();
+        leafOrder = false;
+    }
+
+    inline Vector3 hitNormal(int triangleIndex, float u, float v) const {
+        const IndexedTriangle& indexed = indexedTriangles[triangleIndex];
+        return (vertexNormals[indexed.vertexB] * u + vertexNormals[indexed.vertexC] * v + vertexNormals[indexed.vertexA] * (1 - u - v)).normalize();
+    }
+
+    inline Vector3 hitUV(int triangleIndex, float u, float v) const {
+        const IndexedTriangle& indexed = indexedTriangles[triangleIndex];
+        return vertexUVs[indexed.vertexB] * u + vertexUVs[indexed.vertexC] * v + vertexUVs[indexed.vertexA] * (1 - u - v);
+    }
+
+    // Vertex normals of one object: the vertices [firstVertex, endVertex) average the face normals of the source triangles [firstTriangle, endTriangle)
+    void computeVertexNormals(int firstTriangle, int endTriangle, int firstVertex, int endVertex) {
+        vertexNormals.resize(vertices.size());
+        std::fill(vertexNormals.begin() + firstVertex, vertexNormals.begin() + endVertex, Vector3(0, 0, 0));
+        std::vector<int> slots = leafOrder ? sourceSlots(firstTriangle, endTriangle) : std::vector<int>();
+        for (int i = firstTriangle; i < endTriangle; i++) {
+            const IndexedTriangle& indexed = indexedTriangles[leafOrder ? slots[i - firstTriangle] : i];
+            Vector3 faceNormal = triangle(indexed).normal();
+            vertexNormals[indexed.vertexA] = vertexNormals[indexed.vertexA] + faceNormal;
+            vertexNormals[indexed.vertexB] = vertexNormals[indexed.vertexB] + faceNormal;
+            vertexNormals[indexed.vertexC] = vertexNormals[indexed.vertexC] + faceNormal;
+        }
+        for (int i = firstVertex; i < endVertex; i++) {
+            vertexNormals[i] = vertexNormals[i].normalize();
+        }
+    }
+
+    // Refits the bounds to the current vertices and falls back to a full build once the tree degraded too much, returns whether it was rebuilt.
+    // The kd-tree and the grid are always rebuilt from scratch
+    bool refitAccTree(AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, int optimizationPasses, AccTreeLayout layout, BVH::BuildArena& arena, float& degradation) {
+        if (!IsBVHLayout(layout)) {
+            buildTraversedAccTree(layout);
+            degradation = 1.0f;
+            return true;
+        }
+
+        accTree.refit(gatherTriangles());
+
+        degradation = accTree.builtSahCost > 0 ? accTree.sahCost() / accTree.builtSahCost : 1.0f;
+        bool rebuilt = degradation > REFIT_REBUILD_THRESHOLD;
+        if (rebuilt) {
+            rebuildAccTree(builder, spatialSplitBudget, maxLeafSize, optimizationPasses, layout, arena);
+        }
+        else {
+            buildTraversedAccTree(layout);
+        }
+        return rebuilt;
+    }
+
+    // Builds the tree of an already built mesh again from scratch, e.g. with other build settings.
+    // The binary BVH is only built for the layouts traversed through it
+    void rebuildAccTree(AccTreeBuilder builder, float spatialSplitBudget, int maxLeafSize, int optimizationPasses, AccTreeLayout layout, BVH::BuildArena& arena) {
+        if (!IsBVHLayout(layout)) {
+            clearBinaryAccTree();
+            buildTraversedAccTree(layout);
+            return;
+        }
+
+        restoreSourceOrder();
+        std::vector<Triangle> triangles = gatherTriangles();
+        accTree.build(triangles, builder, spatialSplitBudget, maxLeafSize, arena);
+        accTree.optimize(optimizationPasses);
+        accTree.builtSahCost = accTree.refitSahCost(triangles);
+        buildTraversedAccTree(layout);
+    }
+
+    void clearBinaryAccTree() {
+        restoreSourceOrder();
+        accTree.nodes.clear();
+        accTree.triangleIndices.clear();
+        accTree.builtSahCost = 0.0f;
+    }
+
+    // Builds the structure that is traversed with the layout: collapses the binary tree into a wide one, or builds the kd-tree or the grid
+    // over the indexed triangles. The wide trees keep the leaves of the binary one, so all BVH layouts share its triangle packets and leaf order
+    void buildTraversedAccTree(AccTreeLayout layout) {
+        bool bvhLayout = IsBVHLayout(layout);
+        if (bvhLayout) {
+            reorderToLeafOrder();
+        }
+        else {
+            restoreSourceOrder();
+        }
+        std::vector<Triangle> triangles = bvhLayout ? std::vector<Triangle>() : gatherTriangles();
+        accTree4.build(layout == BVH4 ? accTree : BVH());
+        accTree8.build(layout == BVH8 ? accTree : BVH());
+        compressedAccTree4.build(layout == CompressedBVH4 ? accTree : BVH());
+        compressedAccTree8.build(layout == CompressedBVH8 ? accTree : BVH());
+        kdTree.build(layout == KDTreeSAH ? triangles : std::vector<Triangle>());
+        grid.build(layout == TwoLevelGrid ? triangles : std::vector<Triangle>());
+        triangleRecords.assign(triangles.begin(), triangles.end());
+        buildTrianglePackets(bvhLayout);
+    }
+
+    void buildTrianglePackets(bool bvhLayout) {
+        trianglePackets.clear();
+        leafFirstPacket.clear();
+        if (!bvhLayout) return;
+
+        leafFirstPacket.resize(accTree.triangleIndices.size(), -1);
+        for (const BVHNode& node : accTree.nodes) {
+            if (!node.isLeaf()) continue;
+
+            leafFirstPacket[node.firstTriangle] = (int)trianglePackets.size();
+            for (int offset = 0; offset < node.triangleCount; offset += TRIANGLE_PACKET_WIDTH) {
+                TrianglePacket packet;
+                for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH && offset + lane < node.triangleCount; lane++) {
+                    packet.setTriangle(lane, TriangleRecord(triangle(node.firstTriangle + offset + lane)));
+                }
+                trianglePackets.push_back(packet);
+            }
+        }
+    }
+
+    // Permutes the triangles of a built or loaded BVH so every leaf reads one contiguous range of them, and a hit's slot
+    // reaches its shading attributes directly. Triangles that spatial splits reference from several leaves are duplicated
+    void reorderToLeafOrder() {
+        if (leafOrder) return;
+
+        std::vector<IndexedTriangle> leafOrderTriangles;
+        leafOrderTriangles.reserve(accTree.triangleIndices.size());
+        for (int sourceIndex : accTree.triangleIndices) {
+            leafOrderTriangles.push_back(indexedTriangles[sourceIndex]);
+        }
+        sourceTriangleCount = (int)indexedTriangles.size();
+        indexedTriangles.swap(leafOrderTriangles);
+        leafOrder = true;
+    }
+
+    // Back to source order before the BVH is built again or a layout without it is built, every source triangle is in some leaf
+    void restoreSourceOrder() {
+        if (!leafOrder) return;
+
+        std::vector<IndexedTriangle> sourceTriangles;
+        sourceTriangles.reserve(sourceTriangleCount);
+        for (int slot : sourceSlots(0, sourceTriangleCount)) {
+            sourceTriangles.push_back(indexedTriangles[slot]);
+        }
+        indexedTriangles.swap(sourceTriangles);
+        leafOrder = false;
+    }
+
+    // A leaf slot of each of the source triangles [firstTriangle, endTriangle)
+    std::vector<int> sourceSlots(int firstTriangle, int endTriangle) const {
+        std::vector<int> slots(endTriangle - firstTriangle, 0);
+        for (int slot = 0; slot < (int)accTree.triangleIndices.size(); slot++) {
+            int sourceIndex = accTree.triangleIndices[slot];
+            if (sourceIndex >= firstTriangle && sourceIndex < endTriangle) {
+                slots[sourceIndex - firstTriangle] = slot;
+            }
+        }
+        return slots;
+    }
+
+    // Node count and bytes per node of the layout that is traversed
+    std::pair<size_t, size_t> accTreeNodeStats(AccTreeLayout layout) const {
+        switch (layout) {
+        case BVH4:
+            return { accTree4.nodes.size(), sizeof(WideBVH<4>::Node) };
+        case BVH8:
+            return { accTree8.nodes.size(), sizeof(WideBVH<8>::Node) };
+        case CompressedBVH4:
+            return { compressedAccTree4.nodes.size(), sizeof(CompressedWideBVH<4>::Node) };
+        case CompressedBVH8:
+            return { compressedAccTree8.nodes.size(), sizeof(CompressedWideBVH<8>::Node) };
+        case KDTreeSAH:
+            return { kdTree.nodes.size(), sizeof(KDTreeNode) };
+        case TwoLevelGrid:
+            return { grid.cells.size(), sizeof(GridCell) };
+        default:
+            return { accTree.nodes.size(), sizeof(BVHNode) };
+        }
+    }
+
+    // The kd-tree and the grid are built without a BVH, their own bounds are the current ones
+    AABB bounds() const {
+        if (!grid.levels.empty()) return grid.bounds;
+        if (!kdTree.nodes.empty()) return kdTree.bounds;
+        return accTree.nodes.empty() ? AABB::Empty() : accTree.nodes[0].bounds;
+    }
+};
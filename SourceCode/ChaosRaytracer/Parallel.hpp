@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "Constants.hpp"
+
+// Splits [begin, end) into one chunk per worker thread, small ranges run on the calling thread
+template <typename Function>
+inline void ParallelChunks(int begin, int end, Function function, int minParallelCount = PARALLEL_BINNING_MIN_TRIANGLES) {
+    int count = end - begin;
+    int chunkCount = count >= minParallelCount ? THREADS_TO_USE : 1;
+    if (chunkCount == 1) {
+        function(0, begin, end);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        int chunkBegin = begin + (int)((long long)count * chunk / chunkCount);
+        int chunkEnd = begin + (int)((long long)count * (chunk + 1) / chunkCount);
+        threads.emplace_back(function, chunk, chunkBegin, chunkEnd);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "Vector3.hpp"
+#include "Intersection.hpp"
+
+// A camera sample traced bounce by bounce: the ray of the next bounce and the color gathered so far
+struct Path {
+    Vector3 origin;
+    Vector3 direction;
+    Vector3 finalColor;
+    Vector3 colorPersistance;
+    int bounceNumber;
+    int maxBounces;
+    int pixel;         // pixel of the bucket the color is added to
+
+    Path(const Vector3& _origin, const Vector3& _direction, int _maxBounces, int _pixel = -1)
+        : origin(_origin), direction(_direction), finalColor(0, 0, 0), colorPersistance(1, 1, 1),
+        bounceNumber(0), maxBounces(_maxBounces), pixel(_pixel) {}
+};
+
+// Buffers of the sorted bucket renderer, each thread keeps its own between buckets
+struct PathBuffers {
+    std::vector<Path> paths;
+    std::vector<Path> sortedPaths;
+    std::vector<Intersection> intersections;           // next hit of each path
+    std::vector<std::pair<uint32_t, uint32_t>> order;  // sort key and path index
+};
+
+// Spreads the low 10 bits of value so there are two zero bits between each of them
+inline uint32_t SpreadBits(uint32_t value) {
+    value &= 0x3FF;
+    value = (value | (value << 16)) & 0x030000FF;
+    value = (value | (value << 8)) & 0x0300F00F;
+    value = (value | (value << 4)) & 0x030C30C3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+inline uint32_t MortonCode(uint32_t x, uint32_t y, uint32_t z) {
+    return SpreadBits(x) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "Vector3.hpp"
+
+// Ray with the per ray data of the slab tests computed once: the inverse direction, infinite for zero components,
+// and which slab plane of every axis the ray reaches first
+struct Ray {
+	Vector3 origin;
+	Vector3 direction;
+	Vector3 inverseDirection;
+	int sign[3]; // 1 when the direction component is negative, also for -0
+
+	Ray() : sign{ 0, 0, 0 } {}
+
+	Ray(const Vector3& _origin, const Vector3& _direction)
+		: origin(_origin), direction(_direction), inverseDirection(1.0f / _direction.x, 1.0f / _direction.y, 1.0f / _direction.z) {
+		sign[0] = inverseDirection.x < 0;
+		sign[1] = inverseDirection.y < 0;
+		sign[2] = inverseDirection.z < 0;
+	}
+};
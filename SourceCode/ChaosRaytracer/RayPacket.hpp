@@ -0,0 +1,102 @@
+#pragma once
+
+#include <limits>
+#include <immintrin.h>
+
+#include "Ray.hpp"
+#include "AABB.hpp"
+
+const int RAY_PACKET_SIDE = 4; // packets cover RAY_PACKET_SIDE x RAY_PACKET_SIDE pixels
+const int RAY_PACKET_SIZE = RAY_PACKET_SIDE * RAY_PACKET_SIDE;
+
+// Rays traced through the tree together, only the lanes set in activeMask hold a ray.
+// Origins, inverse directions and closest hit distances are also kept as SoA so one box is tested against all lanes at once
+struct alignas(32) RayPacket {
+    float originX[RAY_PACKET_SIZE];
+    float originY[RAY_PACKET_SIZE];
+    float originZ[RAY_PACKET_SIZE];
+    float inverseX[RAY_PACKET_SIZE];
+    float inverseY[RAY_PACKET_SIZE];
+    float inverseZ[RAY_PACKET_SIZE];
+    float tMax[RAY_PACKET_SIZE];
+    Ray rays[RAY_PACKET_SIZE];
+    int activeMask;
+    int sign[3];   // shared by all lanes when the packet is coherent
+    bool coherent; // all lanes have the same direction signs, so they share the near and far plane of every box
+
+    // The box tests load all lanes, so lanes without a ray get finite values and a tMax no box can be entered before
+    RayPacket() : activeMask(0), sign{ 0, 0, 0 }, coherent(true) {
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            originX[lane] = originY[lane] = originZ[lane] = 0.0f;
+            inverseX[lane] = inverseY[lane] = inverseZ[lane] = 0.0f;
+            tMax[lane] = -std::numeric_limits<float>::infinity();
+        }
+    }
+
+    void setRay(int lane, const Ray& ray) {
+        rays[lane] = ray;
+        originX[lane] = ray.origin.x;
+        originY[lane] = ray.origin.y;
+        originZ[lane] = ray.origin.z;
+        inverseX[lane] = ray.inverseDirection.x;
+        inverseY[lane] = ray.inverseDirection.y;
+        inverseZ[lane] = ray.inverseDirection.z;
+        tMax[lane] = std::numeric_limits<float>::infinity();
+
+        if (activeMask == 0) {
+            sign[0] = ray.sign[0];
+            sign[1] = ray.sign[1];
+            sign[2] = ray.sign[2];
+        }
+        else if (ray.sign[0] != sign[0] || ray.sign[1] != sign[1] || ray.sign[2] != sign[2]) {
+            coherent = false;
+        }
+        activeMask |= 1 << lane;
+    }
+
+    // Slab test of the lanes in mask against one box, only valid for coherent packets. Returns the lanes that hit
+    inline int intersect(const AABB& box, int mask, float* entryDistances) const {
+        float nearX = sign[0] ? box.max.x : box.min.x;
+        float farX = sign[0] ? box.min.x : box.max.x;
+        float nearY = sign[1] ? box.max.y : box.min.y;
+        float farY = sign[1] ? box.min.y : box.max.y;
+        float nearZ = sign[2] ? box.max.z : box.min.z;
+        float farZ = sign[2] ? box.min.z : box.max.z;
+
+        int hitMask = 0;
+#if defined(__AVX2__)
+        for (int first = 0; first < RAY_PACKET_SIZE; first += 8) {
+            if (((mask >> first) & 0xFF) == 0) continue;
+
+            __m256 tEntry = _mm256_setzero_ps();
+            __m256 tExit = _mm256_load_ps(tMax + first);
+            tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nearX), _mm256_load_ps(originX + first)), _mm256_load_ps(inverseX + first)), tEntry);
+            tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(farX), _mm256_load_ps(originX + first)), _mm256_load_ps(inverseX + first)), tExit);
+            tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nearY), _mm256_load_ps(originY + first)), _mm256_load_ps(inverseY + first)), tEntry);
+            tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(farY), _mm256_load_ps(originY + first)), _mm256_load_ps(inverseY + first)), tExit);
+            tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(nearZ), _mm256_load_ps(originZ + first)), _mm256_load_ps(inverseZ + first)), tEntry);
+            tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(farZ), _mm256_load_ps(originZ + first)), _mm256_load_ps(inverseZ + first)), tExit);
+
+            _mm256_storeu_ps(entryDistances + first, tEntry);
+            hitMask |= _mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ)) << first;
+        }
+#else
+        for (int first = 0; first < RAY_PACKET_SIZE; first += 4) {
+            if (((mask >> first) & 0xF) == 0) continue;
+
+            __m128 tEntry = _mm_setzero_ps();
+            __m128 tExit = _mm_load_ps(tMax + first);
+            tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearX), _mm_load_ps(originX + first)), _mm_load_ps(inverseX + first)), tEntry);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farX), _mm_load_ps(originX + first)), _mm_load_ps(inverseX + first)), tExit);
+            tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearY), _mm_load_ps(originY + first)), _mm_load_ps(inverseY + first)), tEntry);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farY), _mm_load_ps(originY + first)), _mm_load_ps(inverseY + first)), tExit);
+            tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(nearZ), _mm_load_ps(originZ + first)), _mm_load_ps(inverseZ + first)), tEntry);
+            tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(farZ), _mm_load_ps(originZ + first)), _mm_load_ps(inverseZ + first)), tExit);
+
+            _mm_storeu_ps(entryDistances + first, tEntry);
+            hitMask |= _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit)) << first;
+        }
+#endif
+        return hitMask & mask;
+    }
+};
@@ -9,49 +9,653 @@ Scene::Scene()
     cameraRotation(Matrix3x3(1, 0, 0, 0, 1, 0, 0, 0, 1)),
     imageWidth(1920),
     imageHeight(1080),
-    rootAABB(Vector3(), Vector3()),
+    accTreeBuilder(BinnedSAH),
+    spatialSplitBudget(SBVH_DUPLICATION_BUDGET),
+    accTreeLeafSize(ACC_TREE_LEAF_SIZE),
+    accTreeOptimizationPasses(ACC_TREE_OPTIMIZATION_PASSES),
+    accTreeLayout(DEFAULT_ACC_TREE_LAYOUT),
+    accTreeCacheOn(ACC_TREE_CACHE_ON),
+    packetTracingOn(PACKET_TRACING_ON),
+    raySortingOn(RAY_SORTING_ON),
     rowsCompleted(0) {}
 
-Intersection Scene::WorldIntersection(const Vector3 ray, const Vector3 position, bool backfaceCullingON)
+Intersection Scene::WorldIntersection(const Ray& ray, bool backfaceCullingON)
 {
-    Intersection closestIntersection = Intersection();
-    if (rootAABB.intersect(position, ray)) {
-        closestIntersection = TraverseKDTree(rootAABB, ray, position, backfaceCullingON);
+    RayHit closestHit;
+    MeshIntersection(worldMesh, ray, backfaceCullingON, closestHit);
+    if (!instances.empty()) {
+        TraverseInstances(ray, backfaceCullingON, closestHit);
     }
-    return closestIntersection;
+    return ResolveHit(closestHit);
 }
 
-Intersection Scene::TraverseKDTree(const AABB& node, const Vector3& ray, const Vector3& position, bool backfaceCullingON)
+// Only finds hits closer than closestHit.distance and updates closestHit with them
+void Scene::MeshIntersection(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
 {
-    Intersection closestIntersection = Intersection();
+    switch (accTreeLayout) {
+    case BVH4:
+        TraverseWideBVH(mesh, mesh.accTree4, ray, backfaceCullingON, closestHit);
+        break;
+    case BVH8:
+        TraverseWideBVH(mesh, mesh.accTree8, ray, backfaceCullingON, closestHit);
+        break;
+    case CompressedBVH4:
+        TraverseWideBVH(mesh, mesh.compressedAccTree4, ray, backfaceCullingON, closestHit);
+        break;
+    case CompressedBVH8:
+        TraverseWideBVH(mesh, mesh.compressedAccTree8, ray, backfaceCullingON, closestHit);
+        break;
+    case KDTreeSAH:
+        TraverseKDTree(mesh, ray, backfaceCullingON, closestHit);
+        break;
+    case TwoLevelGrid:
+        TraverseGrid(mesh, ray, backfaceCullingON, closestHit);
+        break;
+    default:
+        TraverseBVH(mesh, ray, backfaceCullingON, closestHit);
+        break;
+    }
+}
+
+// BVH leaves are tested a triangle packet at a time, the leaf's packets follow each other from leafFirstPacket on
+void Scene::IntersectLeaf(const Mesh& mesh, int firstTriangle, int triangleCount, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    int packetIndex = mesh.leafFirstPacket[firstTriangle];
+    for (int offset = 0; offset < triangleCount; offset += TRIANGLE_PACKET_WIDTH, packetIndex++) {
+        float distance, u, v;
+        int lane = mesh.trianglePackets[packetIndex].intersect(ray, backfaceCullingON, closestHit.distance, distance, u, v);
+        if (lane >= 0) {
+            closestHit.set(firstTriangle + offset + lane, distance, u, v);
+        }
+    }
+}
+
+void Scene::IntersectTriangle(const Mesh& mesh, int triangleIndex, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    float distance, u, v;
+    if (!mesh.triangleRecords[triangleIndex].intersect(ray, backfaceCullingON, closestHit.distance, distance, u, v)) {
+        return;
+    }
+
+    closestHit.set(triangleIndex, distance, u, v);
+}
+
+// Evaluates the shading attributes of the final hit of a ray, instance hits get their normal in world space
+Intersection Scene::ResolveHit(const RayHit& hit)
+{
+    Intersection intersection;
+    if (!hit.isHit()) {
+        return intersection;
+    }
+
+    const Mesh& mesh = hit.instanceIndex == -1 ? worldMesh : meshes[instances[hit.instanceIndex].meshIndex];
+    int materialIndex = mesh.indexedTriangles[hit.triangleIndex].materialIndex;
+    intersection.distance = hit.distance;
+    intersection.type = Hit;
+    intersection.materialIndex = materialIndex;
+    intersection.uv = Vector3(hit.u, hit.v, 1 - hit.u - hit.v);
+    intersection.interpolatedUV = mesh.hitUV(hit.triangleIndex, hit.u, hit.v);
+    intersection.surfaceNormal = materials[materialIndex].smoothShading ? mesh.hitNormal(hit.triangleIndex, hit.u, hit.v) : mesh.triangle(hit.triangleIndex).normal();
+    if (hit.instanceIndex != -1) {
+        intersection.surfaceNormal = instances[hit.instanceIndex].toWorldNormal(intersection.surfaceNormal);
+    }
+    return intersection;
+}
+
+bool Scene::OccludedByLeaf(const Mesh& mesh, int firstTriangle, int triangleCount, const Ray& ray, float maxDistance)
+{
+    int packetIndex = mesh.leafFirstPacket[firstTriangle];
+    for (int offset = 0; offset < triangleCount; offset += TRIANGLE_PACKET_WIDTH, packetIndex++) {
+        if (mesh.trianglePackets[packetIndex].occludes(ray, maxDistance)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scene::TraverseBVH(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit, int rootNodeIndex)
+{
+    struct StackEntry {
+        int nodeIndex;
+        float entryDistance;
+    };
 
-    if (!node.intersect(position, ray)) {
-        return closestIntersection;
+    const BVH& accTree = mesh.accTree;
+    StackEntry stack[BVH_MAX_DEPTH + 1];
+    int stackSize = 0;
+
+    float rootEntryDistance;
+    if (accTree.nodes.empty() || !accTree.nodes[rootNodeIndex].bounds.intersect(ray, closestHit.distance, rootEntryDistance)) {
+        return;
     }
+    stack[stackSize++] = { rootNodeIndex, rootEntryDistance };
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.entryDistance > closestHit.distance) {
+            continue;
+        }
 
-    if (node.isLeaf()) {
-        for (auto& triangle : node.triangles) {
-            Intersection intersection = triangle.intersect(ray, position, backfaceCullingON);
-            if (intersection.distance < closestIntersection.distance) {
-                closestIntersection = intersection;
-                closestIntersection.materialIndex = triangle.materialIndex;
-                closestIntersection.surfaceNormal = triangle.hitNormal(intersection.uv.u, intersection.uv.v);
+        const BVHNode& node = accTree.nodes[entry.nodeIndex];
+        if (node.isLeaf()) {
+            IntersectLeaf(mesh, node.firstTriangle, node.triangleCount, ray, backfaceCullingON, closestHit);
+            continue;
+        }
+
+        int childA = entry.nodeIndex + 1;
+        int childB = node.secondChild;
+        float distanceA, distanceB;
+        bool hitA = accTree.nodes[childA].bounds.intersect(ray, closestHit.distance, distanceA);
+        bool hitB = accTree.nodes[childB].bounds.intersect(ray, closestHit.distance, distanceB);
+
+        if (hitA && hitB) {
+            // Push the farther child first so the nearer one is visited next
+            if (distanceB < distanceA) {
+                std::swap(childA, childB);
+                std::swap(distanceA, distanceB);
             }
+            stack[stackSize++] = { childB, distanceB };
+            stack[stackSize++] = { childA, distanceA };
+        }
+        else if (hitA) {
+            stack[stackSize++] = { childA, distanceA };
+        }
+        else if (hitB) {
+            stack[stackSize++] = { childB, distanceB };
         }
     }
-    else {
-        Intersection leftIntersection = Scene::TraverseKDTree(*node.childA, ray, position, backfaceCullingON);
-        Intersection rightIntersection = Scene::TraverseKDTree(*node.childB, ray, position, backfaceCullingON);
+}
+
+// Closest hits of all packet lanes, the same as WorldIntersection of each lane. Packets only traverse the binary BVH,
+// so the kd-tree and the grid trace their lanes one by one
+void Scene::PacketIntersection(RayPacket& packet, bool backfaceCullingON, Intersection* closestIntersections)
+{
+    if (!packet.coherent || !IsBVHLayout(accTreeLayout)) {
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (packet.activeMask & (1 << lane)) {
+                closestIntersections[lane] = WorldIntersection(packet.rays[lane], backfaceCullingON);
+            }
+        }
+        return;
+    }
+
+    RayHit closestHits[RAY_PACKET_SIZE];
+    TraverseBVHPacket(worldMesh, packet, backfaceCullingON, closestHits);
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(packet.activeMask & (1 << lane))) continue;
+        if (!instances.empty()) {
+            TraverseInstances(packet.rays[lane], backfaceCullingON, closestHits[lane]);
+        }
+        closestIntersections[lane] = ResolveHit(closestHits[lane]);
+    }
+}
+
+// Every node is tested once for all lanes that reached it. Subtrees reached by fewer than PACKET_MIN_ACTIVE_RAYS lanes
+// are finished by single ray traversal, since the packet no longer pays off there
+void Scene::TraverseBVHPacket(const Mesh& mesh, RayPacket& packet, bool backfaceCullingON, RayHit* closestHits)
+{
+    struct StackEntry {
+        int nodeIndex;
+        int mask;
+    };
+
+    const BVH& accTree = mesh.accTree;
+    StackEntry stack[BVH_MAX_DEPTH + 1];
+    int stackSize = 0;
+    alignas(32) float distancesA[RAY_PACKET_SIZE];
+    alignas(32) float distancesB[RAY_PACKET_SIZE];
+
+    int rootMask = accTree.nodes.empty() ? 0 : packet.intersect(accTree.nodes[0].bounds, packet.activeMask, distancesA);
+    if (rootMask == 0) {
+        return;
+    }
+    stack[stackSize++] = { 0, rootMask };
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        const BVHNode& node = accTree.nodes[entry.nodeIndex];
+
+        if (node.isLeaf() || std::popcount((unsigned)entry.mask) < PACKET_MIN_ACTIVE_RAYS) {
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                if ((entry.mask & (1 << lane)) == 0) continue;
+
+                if (node.isLeaf()) {
+                    IntersectLeaf(mesh, node.firstTriangle, node.triangleCount, packet.rays[lane], backfaceCullingON, closestHits[lane]);
+                }
+                else {
+                    TraverseBVH(mesh, packet.rays[lane], backfaceCullingON, closestHits[lane], entry.nodeIndex);
+                }
+                packet.tMax[lane] = closestHits[lane].distance;
+            }
+            continue;
+        }
+
+        int childA = entry.nodeIndex + 1;
+        int childB = node.secondChild;
+        int maskA = packet.intersect(accTree.nodes[childA].bounds, entry.mask, distancesA);
+        int maskB = packet.intersect(accTree.nodes[childB].bounds, entry.mask, distancesB);
+
+        if (maskA && maskB) {
+            // The lanes share direction signs, so the first lane that hits both children decides the order for all of them
+            int bothMask = maskA & maskB;
+            if (bothMask && distancesB[std::countr_zero((unsigned)bothMask)] < distancesA[std::countr_zero((unsigned)bothMask)]) {
+                std::swap(childA, childB);
+                std::swap(maskA, maskB);
+            }
+            stack[stackSize++] = { childB, maskB };
+            stack[stackSize++] = { childA, maskA };
+        }
+        else if (maskA) {
+            stack[stackSize++] = { childA, maskA };
+        }
+        else if (maskB) {
+            stack[stackSize++] = { childB, maskB };
+        }
+    }
+}
+
+bool Scene::WorldOcclusion(const Ray& ray, float maxDistance)
+{
+    return MeshOcclusion(worldMesh, ray, maxDistance) || (!instances.empty() && TraverseInstancesAnyHit(ray, maxDistance));
+}
+
+bool Scene::MeshOcclusion(const Mesh& mesh, const Ray& ray, float maxDistance)
+{
+    switch (accTreeLayout) {
+    case BVH4:
+        return TraverseWideBVHAnyHit(mesh, mesh.accTree4, ray, maxDistance);
+    case BVH8:
+        return TraverseWideBVHAnyHit(mesh, mesh.accTree8, ray, maxDistance);
+    case CompressedBVH4:
+        return TraverseWideBVHAnyHit(mesh, mesh.compressedAccTree4, ray, maxDistance);
+    case CompressedBVH8:
+        return TraverseWideBVHAnyHit(mesh, mesh.compressedAccTree8, ray, maxDistance);
+    case KDTreeSAH:
+        return TraverseKDTreeAnyHit(mesh, ray, maxDistance);
+    case TwoLevelGrid:
+        return TraverseGridAnyHit(mesh, ray, maxDistance);
+    default:
+        return TraverseBVHAnyHit(mesh, ray, maxDistance);
+    }
+}
+
+// Stops at the first triangle closer than maxDistance, the order of visiting does not matter
+bool Scene::TraverseBVHAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance)
+{
+    const BVH& accTree = mesh.accTree;
+    int stack[BVH_MAX_DEPTH + 1];
+    int stackSize = 0;
+    float entryDistance;
+
+    if (accTree.nodes.empty() || !accTree.nodes[0].bounds.intersect(ray, maxDistance, entryDistance)) {
+        return false;
+    }
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        const BVHNode& node = accTree.nodes[nodeIndex];
+
+        if (node.isLeaf()) {
+            if (OccludedByLeaf(mesh, node.firstTriangle, node.triangleCount, ray, maxDistance)) {
+                return true;
+            }
+            continue;
+        }
+
+        if (accTree.nodes[node.secondChild].bounds.intersect(ray, maxDistance, entryDistance)) {
+            stack[stackSize++] = node.secondChild;
+        }
+        if (accTree.nodes[nodeIndex + 1].bounds.intersect(ray, maxDistance, entryDistance)) {
+            stack[stackSize++] = nodeIndex + 1;
+        }
+    }
+
+    return false;
+}
+
+// Visits the cells along the ray front to back, so the first cell with a hit inside it ends the search.
+// A hit found in an earlier cell can lie further along the ray in a cell that was not visited yet, then closest.distance
+// is still larger than that cell's entry distance and the search goes on
+void Scene::TraverseKDTree(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    struct StackEntry {
+        int nodeIndex;
+        float entryDistance;
+        float exitDistance;
+    };
+    const KDTree& kdTree = mesh.kdTree;
+    StackEntry stack[KD_TREE_MAX_DEPTH + 1];
+    int stackSize = 0;
+    float tMin, tMax;
+
+    if (kdTree.nodes.empty() || !kdTree.bounds.clip(ray, closestHit.distance, tMin, tMax)) {
+        return;
+    }
 
-        if (leftIntersection.distance < closestIntersection.distance) {
-            closestIntersection = leftIntersection;
+    int nodeIndex = 0;
+    while (true) {
+        if (closestHit.distance < tMin) {
+            return;
         }
-        if (rightIntersection.distance < closestIntersection.distance) {
-            closestIntersection = rightIntersection;
+
+        const KDTreeNode& node = kdTree.nodes[nodeIndex];
+        if (!node.isLeaf()) {
+            int axis = node.axis();
+            float origin = AABB::axisValue(ray.origin, axis);
+            float planeDistance = (node.split - origin) * AABB::axisValue(ray.inverseDirection, axis);
+            bool belowFirst = origin < node.split || (origin == node.split && ray.sign[axis]);
+            int firstChild = belowFirst ? nodeIndex + 1 : node.aboveChild();
+            int secondChild = belowFirst ? node.aboveChild() : nodeIndex + 1;
+
+            if (planeDistance >= tMax || !(planeDistance > 0)) {
+                nodeIndex = firstChild;
+            }
+            else if (planeDistance < tMin) {
+                nodeIndex = secondChild;
+            }
+            else {
+                stack[stackSize++] = { secondChild, planeDistance, tMax };
+                nodeIndex = firstChild;
+                tMax = planeDistance;
+            }
+            continue;
+        }
+
+        for (int i = node.firstTriangle; i < node.firstTriangle + node.triangleCount(); i++) {
+            IntersectTriangle(mesh, kdTree.triangleIndices[i], ray, backfaceCullingON, closestHit);
+        }
+
+        if (stackSize == 0) {
+            return;
+        }
+        stackSize--;
+        nodeIndex = stack[stackSize].nodeIndex;
+        tMin = stack[stackSize].entryDistance;
+        tMax = stack[stackSize].exitDistance;
+    }
+}
+
+bool Scene::TraverseKDTreeAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance)
+{
+    struct StackEntry {
+        int nodeIndex;
+        float entryDistance;
+        float exitDistance;
+    };
+    const KDTree& kdTree = mesh.kdTree;
+    StackEntry stack[KD_TREE_MAX_DEPTH + 1];
+    int stackSize = 0;
+    float tMin, tMax;
+
+    if (kdTree.nodes.empty() || !kdTree.bounds.clip(ray, maxDistance, tMin, tMax)) {
+        return false;
+    }
+
+    int nodeIndex = 0;
+    while (true) {
+        const KDTreeNode& node = kdTree.nodes[nodeIndex];
+        if (!node.isLeaf()) {
+            int axis = node.axis();
+            float origin = AABB::axisValue(ray.origin, axis);
+            float planeDistance = (node.split - origin) * AABB::axisValue(ray.inverseDirection, axis);
+            bool belowFirst = origin < node.split || (origin == node.split && ray.sign[axis]);
+            int firstChild = belowFirst ? nodeIndex + 1 : node.aboveChild();
+            int secondChild = belowFirst ? node.aboveChild() : nodeIndex + 1;
+
+            if (planeDistance >= tMax || !(planeDistance > 0)) {
+                nodeIndex = firstChild;
+            }
+            else if (planeDistance < tMin) {
+                nodeIndex = secondChild;
+            }
+            else {
+                stack[stackSize++] = { secondChild, planeDistance, tMax };
+                nodeIndex = firstChild;
+                tMax = planeDistance;
+            }
+            continue;
+        }
+
+        for (int i = node.firstTriangle; i < node.firstTriangle + node.triangleCount(); i++) {
+            if (mesh.triangleRecords[kdTree.triangleIndices[i]].occludes(ray, maxDistance)) {
+                return true;
+            }
+        }
+
+        if (stackSize == 0) {
+            return false;
         }
+        stackSize--;
+        nodeIndex = stack[stackSize].nodeIndex;
+        tMin = stack[stackSize].entryDistance;
+        tMax = stack[stackSize].exitDistance;
     }
+}
 
-    return closestIntersection;
+// Walks the top level cells and the sub grids inside them in order along the ray. A triangle overlapping several cells
+// is tested in each of them, a hit no further than the exit of the current cell is the closest one
+void Scene::TraverseGrid(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    const Grid& grid = mesh.grid;
+    float entryDistance, exitDistance;
+    if (grid.levels.empty() || !grid.bounds.clip(ray, closestHit.distance, entryDistance, exitDistance)) {
+        return;
+    }
+
+    auto intersectCell = [&](const GridCell& cell, float, float cellExit) {
+        for (int i = cell.first; i < cell.first + cell.count; i++) {
+            IntersectTriangle(mesh, grid.triangleIndices[i], ray, backfaceCullingON, closestHit);
+        }
+        return closestHit.distance <= cellExit;
+    };
+
+    grid.walk(0, ray, entryDistance, exitDistance, [&](const GridCell& cell, float cellEntry, float cellExit) {
+        if (cell.hasSubGrid()) {
+            return grid.walk(cell.first, ray, cellEntry, cellExit, intersectCell);
+        }
+        return intersectCell(cell, cellEntry, cellExit);
+    });
+}
+
+bool Scene::TraverseGridAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance)
+{
+    const Grid& grid = mesh.grid;
+    float entryDistance, exitDistance;
+    if (grid.levels.empty() || !grid.bounds.clip(ray, maxDistance, entryDistance, exitDistance)) {
+        return false;
+    }
+
+    auto occludedByCell = [&](const GridCell& cell, float, float) {
+        for (int i = cell.first; i < cell.first + cell.count; i++) {
+            if (mesh.triangleRecords[grid.triangleIndices[i]].occludes(ray, maxDistance)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    return grid.walk(0, ray, entryDistance, exitDistance, [&](const GridCell& cell, float cellEntry, float cellExit) {
+        if (cell.hasSubGrid()) {
+            return grid.walk(cell.first, ray, cellEntry, cellExit, occludedByCell);
+        }
+        return occludedByCell(cell, cellEntry, cellExit);
+    });
+}
+
+template <typename WideTree>
+void Scene::TraverseWideBVH(const Mesh& mesh, const WideTree& tree, const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    struct StackEntry {
+        int child;
+        int triangleCount;
+        float entryDistance;
+    };
+
+    if (tree.nodes.empty()) {
+        return;
+    }
+
+    constexpr int Width = WideTree::WIDTH;
+    StackEntry stack[BVH_MAX_DEPTH * Width];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0, 0 };
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.entryDistance > closestHit.distance) {
+            continue;
+        }
+
+        if (entry.triangleCount > 0) {
+            IntersectLeaf(mesh, entry.child, entry.triangleCount, ray, backfaceCullingON, closestHit);
+            continue;
+        }
+
+        const typename WideTree::Node& node = tree.nodes[entry.child];
+        alignas(32) float entryDistances[Width];
+        int hitMask = tree.intersectChildren(node, ray, closestHit.distance, entryDistances);
+
+        // Push the hit children from the farthest to the nearest so the nearest is visited next
+        int firstPushed = stackSize;
+        for (int i = 0; i < Width; i++) {
+            if (!(hitMask & (1 << i))) continue;
+            StackEntry childEntry = { node.child[i], node.triangleCount[i], entryDistances[i] };
+            int j = stackSize++;
+            while (j > firstPushed && stack[j - 1].entryDistance < childEntry.entryDistance) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = childEntry;
+        }
+    }
+}
+
+template <typename WideTree>
+bool Scene::TraverseWideBVHAnyHit(const Mesh& mesh, const WideTree& tree, const Ray& ray, float maxDistance)
+{
+    if (tree.nodes.empty()) {
+        return false;
+    }
+
+    constexpr int Width = WideTree::WIDTH;
+    int stack[BVH_MAX_DEPTH * Width];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const typename WideTree::Node& node = tree.nodes[stack[--stackSize]];
+        alignas(32) float entryDistances[Width];
+        int hitMask = tree.intersectChildren(node, ray, maxDistance, entryDistances);
+
+        for (int i = 0; i < Width; i++) {
+            if (!(hitMask & (1 << i))) continue;
+            if (node.triangleCount[i] == 0) {
+                stack[stackSize++] = node.child[i];
+            }
+            else if (OccludedByLeaf(mesh, node.child[i], node.triangleCount[i], ray, maxDistance)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+// Top level traversal, every instance that is reached traces the ray through its mesh in object space
+void Scene::TraverseInstances(const Ray& ray, bool backfaceCullingON, RayHit& closestHit)
+{
+    struct StackEntry {
+        int nodeIndex;
+        float entryDistance;
+    };
+
+    StackEntry stack[BVH_MAX_DEPTH + 1];
+    int stackSize = 0;
+
+    float rootEntryDistance;
+    if (instanceTree.nodes.empty() || !instanceTree.nodes[0].bounds.intersect(ray, closestHit.distance, rootEntryDistance)) {
+        return;
+    }
+    stack[stackSize++] = { 0, rootEntryDistance };
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        if (entry.entryDistance > closestHit.distance) {
+            continue;
+        }
+
+        const BVHNode& node = instanceTree.nodes[entry.nodeIndex];
+        if (node.isLeaf()) {
+            for (int i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++) {
+                int instanceIndex = instanceTree.triangleIndices[i];
+                const Instance& instance = instances[instanceIndex];
+                float previousDistance = closestHit.distance;
+                MeshIntersection(meshes[instance.meshIndex], Ray(instance.toObjectPoint(ray.origin), instance.toObjectDirection(ray.direction)), backfaceCullingON, closestHit);
+                if (closestHit.distance < previousDistance) {
+                    closestHit.instanceIndex = instanceIndex;
+                }
+            }
+            continue;
+        }
+
+        int childA = entry.nodeIndex + 1;
+        int childB = node.secondChild;
+        float distanceA, distanceB;
+        bool hitA = instanceTree.nodes[childA].bounds.intersect(ray, closestHit.distance, distanceA);
+        bool hitB = instanceTree.nodes[childB].bounds.intersect(ray, closestHit.distance, distanceB);
+
+        if (hitA && hitB) {
+            if (distanceB < distanceA) {
+                std::swap(childA, childB);
+                std::swap(distanceA, distanceB);
+            }
+            stack[stackSize++] = { childB, distanceB };
+            stack[stackSize++] = { childA, distanceA };
+        }
+        else if (hitA) {
+            stack[stackSize++] = { childA, distanceA };
+        }
+        else if (hitB) {
+            stack[stackSize++] = { childB, distanceB };
+        }
+    }
+}
+
+bool Scene::TraverseInstancesAnyHit(const Ray& ray, float maxDistance)
+{
+    int stack[BVH_MAX_DEPTH + 1];
+    int stackSize = 0;
+    float entryDistance;
+
+    if (instanceTree.nodes.empty() || !instanceTree.nodes[0].bounds.intersect(ray, maxDistance, entryDistance)) {
+        return false;
+    }
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        int nodeIndex = stack[--stackSize];
+        const BVHNode& node = instanceTree.nodes[nodeIndex];
+
+        if (node.isLeaf()) {
+            for (int i = node.firstTriangle; i < node.firstTriangle + node.triangleCount; i++) {
+                const Instance& instance = instances[instanceTree.triangleIndices[i]];
+                if (MeshOcclusion(meshes[instance.meshIndex], Ray(instance.toObjectPoint(ray.origin), instance.toObjectDirection(ray.direction)), maxDistance)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        if (instanceTree.nodes[node.secondChild].bounds.intersect(ray, maxDistance, entryDistance)) {
+            stack[stackSize++] = node.secondChild;
+        }
+        if (instanceTree.nodes[nodeIndex + 1].bounds.intersect(ray, maxDistance, entryDistance)) {
+            stack[stackSize++] = nodeIndex + 1;
+        }
+    }
+
+    return false;
 }
 
 Vector3 Scene::Refract(const Vector3& incident, const Vector3& normal, float ior)
@@ -94,17 +698,16 @@ float Scene::Fresnel(const Vector3& incident, const Vector3& normal, float ior)
     }
 }
 
-Vector3 Scene::Diffuse(Vector3& intersectionPoint, Vector3& surfaceNormal)
+Vector3 Scene::Diffuse(const Vector3& intersectionPoint, const Vector3& surfaceNormal)
 {
     Vector3 lightContribution = Vector3(0,0,0);
 
     for (const auto& light : lights) {
         Vector3 lightDir = (light.position - intersectionPoint).normalize();
         Vector3 fromLightDir = (intersectionPoint - light.position).normalize();
+        float distanceToLight = (light.position - intersectionPoint).length();
 
-        Intersection intersection = WorldIntersection(fromLightDir, light.position, false);
-
-        if (intersection.distance + EPSILON < (light.position - intersectionPoint).length()) {
+        if (WorldOcclusion(Ray(light.position, fromLightDir), distanceToLight - EPSILON)) {
             continue;
         }
 
@@ -119,76 +722,193 @@ Vector3 Scene::Diffuse(Vector3& intersectionPoint, Vector3& surfaceNormal)
 }
 
 Vector3 Scene::RayTraceRay(const Vector3& origin, const Vector3& ray, int maxBounces, bool backfaceCullingON) {
-    Vector3 finalColor = Vector3(0, 0, 0);
-    Vector3 colorPersistance = Vector3(1, 1, 1);
-    Vector3 rayOrigin = origin;
-    Vector3 currentRay = ray;
+    if (maxBounces <= 0) {
+        return Vector3(0, 0, 0);
+    }
+    return ShadeRay(origin, ray, WorldIntersection(Ray(origin, ray), backfaceCullingON), maxBounces, backfaceCullingON);
+}
+
+// Continues tracing a ray whose first intersection is already known
+Vector3 Scene::ShadeRay(const Vector3& origin, const Vector3& ray, Intersection intersection, int maxBounces, bool backfaceCullingON) {
+    Path path(origin, ray, maxBounces);
+    while (ShadeBounce(path, intersection, backfaceCullingON)) {
+        intersection = WorldIntersection(Ray(path.origin, path.direction), backfaceCullingON);
+    }
+    return path.finalColor;
+}
+
+// Adds the light gathered at the path's current intersection. Returns true when the path continues with
+// another bounce, its origin and direction are then the ray to trace next
+bool Scene::ShadeBounce(Path& path, const Intersection& intersection, bool backfaceCullingON) {
+    if (intersection.type == Miss ) {
+        path.finalColor = path.finalColor + path.colorPersistance * defaultColor;
+        return false;
+    }
+
+    Vector3 intersectionPoint = path.origin + path.direction * intersection.distance;
+    Material& material = materials[intersection.materialIndex];
+
+    Vector3 color = material.albedo.GetColorFromMaterial(intersection.uv, intersection.interpolatedUV);
+
+    path.colorPersistance = path.colorPersistance * color;
 
-    for (int bounceNumber = 0; bounceNumber < maxBounces; bounceNumber++) {
-        Intersection intersection = WorldIntersection(currentRay, rayOrigin, backfaceCullingON);
+    if (material.type == diffuse) {
+        Vector3 lightContribution = Diffuse(intersectionPoint, intersection.surfaceNormal);
+        path.finalColor = path.finalColor + path.colorPersistance * lightContribution;
 
-        if (intersection.type == Miss ) {
-            finalColor = finalColor + colorPersistance * defaultColor;
-            break;
+        if (globalIluminationOn) {
+            path.direction = RandomHemisphereDirection(intersection.surfaceNormal).normalize();
+            path.origin = intersectionPoint + path.direction * EPSILON;
         }
+        else {
+            return false;
+        }
+    }
 
-        Vector3 intersectionPoint = rayOrigin + currentRay * intersection.distance;
-        Material& material = materials[intersection.materialIndex];
+    if (material.type == reflective) {
+        path.direction = (path.direction - intersection.surfaceNormal * 2 * (path.direction.dot(intersection.surfaceNormal))).normalize();
+        path.origin = intersectionPoint + path.direction * EPSILON;
+    }
 
-        Vector3 color = material.albedo.GetColorFromMaterial(intersection.uv, intersection.interpolatedUV);
+    if (material.type == constant) {
+        path.finalColor = path.finalColor + path.colorPersistance;
+        return false;
+    }
+
+    if (material.type == refractive) {
+        float kr = Fresnel(path.direction, intersection.surfaceNormal, material.ior);
+        Vector3 reflectedRay = (path.direction - intersection.surfaceNormal * 2 * (path.direction.dot(intersection.surfaceNormal))).normalize();
+        Vector3 refractedRay = Refract(path.direction, intersection.surfaceNormal, material.ior).normalize();
+
+        Vector3 reflectedColor = RayTraceRay(intersectionPoint + reflectedRay * EPSILON, reflectedRay, std::min(path.maxBounces - 1, 1), backfaceCullingON);
+        Vector3 refractedColor = RayTraceRay(intersectionPoint + refractedRay * EPSILON, refractedRay, (path.maxBounces - 1), false);
 
-        colorPersistance = colorPersistance * color;
+        path.finalColor = path.finalColor + path.colorPersistance * (reflectedColor * kr + refractedColor * (1 - kr));
+        return false;
+    }
 
-        if (material.type == diffuse) {
-            Vector3 lightContribution = Diffuse(intersectionPoint, intersection.surfaceNormal);
-            finalColor = finalColor + colorPersistance * lightContribution;
+    if (path.colorPersistance.r < EPSILON && path.colorPersistance.g < EPSILON && path.colorPersistance.b < EPSILON) {
+        return false;
+    }
 
-            if (globalIluminationOn) {
-                currentRay = RandomHemisphereDirection(intersection.surfaceNormal).normalize();
-                rayOrigin = intersectionPoint + currentRay * EPSILON;
+    return ++path.bounceNumber < path.maxBounces;
+}
+
+Vector3 Scene::PrimaryRayDirection(float pixelX, float pixelY) {
+    float x = pixelX / imageWidth;  // from 0 to 1
+    float y = pixelY / imageHeight; // from 0 to 1
+
+    x = (2.0f * x) - 1.0f; // from -1 to 1
+    y = 1.0f - (2.0f * y); // from -1 to 1
+
+    float aspectRatio = (float)imageWidth / (float)imageHeight;
+    x *= aspectRatio; // from -ar to ar
+
+    return (cameraRotation * Vector3(x, y, -1)).normalize();
+}
+
+Vector3 Scene::RayTrace(float pixelX, float pixelY) {
+    return RayTraceRay(cameraPosition, PrimaryRayDirection(pixelX, pixelY), MAXIMUM_RAY_BOUNCES_COUNT, true);
+}
+
+
+// Jittered camera rays of one sample for the pixels of a RAY_PACKET_SIDE x RAY_PACKET_SIDE tile, clipped to the bucket
+RayPacket Scene::CameraPacket(int tileX, int tileY, int endX, int endY) {
+    RayPacket packet;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        int imageX = tileX + lane % RAY_PACKET_SIDE;
+        int imageY = tileY + lane / RAY_PACKET_SIDE;
+        if (imageX >= endX || imageY >= endY) continue;
+
+        float randomX = ((float)rand() / (RAND_MAX)) + imageX;
+        float randomY = ((float)rand() / (RAND_MAX)) + imageY;
+        packet.setRay(lane, Ray(cameraPosition, PrimaryRayDirection(randomX, randomY)));
+    }
+    return packet;
+}
+
+// Direction octant above the Morton code of the origin's cell on a 512^3 grid over the scene
+uint32_t Scene::RayOrderKey(const Vector3& origin, const Vector3& direction) const {
+    Vector3 extent = raySortingBounds.max - raySortingBounds.min;
+    auto cell = [](float value, float min, float extent) {
+        return extent > 0 ? (uint32_t)std::max(0.0f, std::min(511.0f, (value - min) / extent * 512.0f)) : 0u;
+    };
+
+    uint32_t octant = (direction.x < 0 ? 1u : 0u) | (direction.y < 0 ? 2u : 0u) | (direction.z < 0 ? 4u : 0u);
+    uint32_t originCell = MortonCode(cell(origin.x, raySortingBounds.min.x, extent.x), cell(origin.y, raySortingBounds.min.y, extent.y), cell(origin.z, raySortingBounds.min.z, extent.z));
+    return (octant << 27) | originCell;
+}
+
+// Traces all samples of a bucket one bounce at a time. Before every bounce the rays are sorted by RayOrderKey,
+// so rays that are traced one after the other start close together and go the same way and touch the same nodes
+void Scene::RenderBucketSorted(int startX, int startY, int endX, int endY, PathBuffers& buffers) {
+    int bucketWidth = endX - startX;
+    std::vector<Vector3> pixelColors((endY - startY) * bucketWidth, Vector3(0, 0, 0));
+    std::vector<Path>& paths = buffers.paths;
+    std::vector<Intersection>& intersections = buffers.intersections;
+    paths.clear();
+    intersections.clear();
+
+    for (int tileY = startY; tileY < endY; tileY += RAY_PACKET_SIDE) {
+        for (int tileX = startX; tileX < endX; tileX += RAY_PACKET_SIDE) {
+            for (int rayNumber = 0; rayNumber < RAYS_PER_PIXEL; rayNumber++) {
+                RayPacket packet = CameraPacket(tileX, tileY, endX, endY);
+                Intersection packetIntersections[RAY_PACKET_SIZE];
+                if (packetTracingOn) {
+                    PacketIntersection(packet, true, packetIntersections);
+                }
+
+                for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                    if ((packet.activeMask & (1 << lane)) == 0) continue;
+
+                    if (!packetTracingOn) {
+                        packetIntersections[lane] = WorldIntersection(packet.rays[lane], true);
+                    }
+                    int pixel = (tileY + lane / RAY_PACKET_SIDE - startY) * bucketWidth + (tileX + lane % RAY_PACKET_SIDE - startX);
+                    paths.emplace_back(cameraPosition, packet.rays[lane].direction, MAXIMUM_RAY_BOUNCES_COUNT, pixel);
+                    intersections.push_back(packetIntersections[lane]);
+                }
+            }
+        }
+    }
+
+    while (!paths.empty()) {
+        size_t continuing = 0;
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (ShadeBounce(paths[i], intersections[i], true)) {
+                paths[continuing++] = paths[i];
             }
             else {
-                break;
+                pixelColors[paths[i].pixel] = pixelColors[paths[i].pixel] + paths[i].finalColor;
             }
         }
+        paths.erase(paths.begin() + continuing, paths.end());
 
-        if (material.type == reflective) {
-            currentRay = (currentRay - intersection.surfaceNormal * 2 * (currentRay.dot(intersection.surfaceNormal))).normalize();
-            rayOrigin = intersectionPoint + currentRay * EPSILON;
+        // Sorting keys and indices and gathering afterwards moves every path only once
+        buffers.order.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            buffers.order[i] = { RayOrderKey(paths[i].origin, paths[i].direction), (uint32_t)i };
         }
-
-        if (material.type == constant) {
-            finalColor = finalColor + colorPersistance;
-            break;
+        std::sort(buffers.order.begin(), buffers.order.end());
+        buffers.sortedPaths.clear();
+        for (const auto& [key, index] : buffers.order) {
+            buffers.sortedPaths.push_back(paths[index]);
         }
+        std::swap(paths, buffers.sortedPaths);
 
-        if (material.type == refractive) {
-            float kr = Fresnel(currentRay, intersection.surfaceNormal, material.ior);
-            Vector3 reflectedRay = (currentRay - intersection.surfaceNormal * 2 * (currentRay.dot(intersection.surfaceNormal))).normalize();
-            Vector3 refractedRay = Refract(currentRay, intersection.surfaceNormal, material.ior).normalize();
-
-            Vector3 reflectedColor = RayTraceRay(intersectionPoint + reflectedRay * EPSILON, reflectedRay, std::min(maxBounces - 1, 1), backfaceCullingON);
-            Vector3 refractedColor = RayTraceRay(intersectionPoint + refractedRay * EPSILON, refractedRay, (maxBounces - 1), false);
-
-            finalColor = finalColor + colorPersistance * (reflectedColor * kr + refractedColor * (1 - kr));
-            break;
+        intersections.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++) {
+            intersections[i] = WorldIntersection(Ray(paths[i].origin, paths[i].direction), true);
         }
+    }
 
-        if (colorPersistance.r < EPSILON && colorPersistance.g < EPSILON && colorPersistance.b < EPSILON) {
-            break;
+    for (int imageY = startY; imageY < endY; imageY++) {
+        for (int imageX = startX; imageX < endX; imageX++) {
+            imageBuffer[imageY][imageX] = pixelColors[(imageY - startY) * bucketWidth + (imageX - startX)] / (float)RAYS_PER_PIXEL;
         }
     }
-
-    return finalColor;
 }
 
-Vector3 Scene::RayTrace(float imageX, float imageY) {
-    Vector3 rayOrigin = cameraPosition;
-    Vector3 ray = (cameraRotation * Vector3(imageX, imageY, -1)).normalize();
-    return RayTraceRay(rayOrigin, ray, MAXIMUM_RAY_BOUNCES_COUNT, true);
-}
-
-
 int Scene::colorFromDecimalToWholeRepresentation(float value) {
     value = std::min(1.0f, std::max(0.0f, value));
     return (int)std::round(value * MAX_COLOR_COMPONENT);
@@ -199,6 +919,39 @@ std::string Scene::colorToPPMFormat(Vector3 color) {
 }
 
 void Scene::renderFrame(int frameNumber) {
+    auto renderStart = std::chrono::high_resolution_clock::now();
+    RenderImage();
+    auto renderStop = std::chrono::high_resolution_clock::now();
+    std::cout << "Frame " << frameNumber << " rendered in: " << std::chrono::duration_cast<std::chrono::milliseconds>(renderStop - renderStart).count() << " ms" << std::endl;
+
+    std::stringstream ss;
+    ss << std::setw(4) << std::setfill('0') << frameNumber;
+    std::string fileName = "output/frame_" + ss.str() + ".ppm";
+
+    std::ofstream ppmFileStream(fileName, std::ios::out | std::ios::binary);
+    if (!ppmFileStream.is_open()) {
+        std::cerr << "Could not open the file!" << std::endl;
+        return;
+    }
+
+    // Init ppm
+    ppmFileStream << "P3\n" << imageWidth << " " << imageHeight << "\n" << MAX_COLOR_COMPONENT << "\n";
+
+    for (int imageY = 0; imageY < imageHeight; ++imageY) {
+        for (int imageX = 0; imageX < imageWidth; ++imageX) {
+            ppmFileStream << colorToPPMFormat(imageBuffer[imageY][imageX]);
+            if (imageX < imageWidth - 1) {
+                ppmFileStream << " ";
+            }
+        }
+        ppmFileStream << "\n";
+    }
+
+    ppmFileStream.close();
+}
+
+// Renders the current camera view into imageBuffer
+void Scene::RenderImage() {
     imageBuffer = std::vector<std::vector<Vector3>>(imageHeight, std::vector<Vector3>(imageWidth, Vector3(0, 0, 0)));
     rowsCompleted = 0;
 
@@ -208,7 +961,14 @@ void Scene::renderFrame(int frameNumber) {
         }
     }
 
+    // Bounding box of everything rays can hit, ray sorting places ray origins on a grid over it
+    raySortingBounds = worldMesh.bounds();
+    if (!instanceTree.nodes.empty()) {
+        raySortingBounds.expandToInclude(instanceTree.nodes[0].bounds);
+    }
+
     auto renderChunk = [this]() {
+        PathBuffers pathBuffers;
         while (true) {
             int startY, startX;
             {
@@ -223,28 +983,53 @@ void Scene::renderFrame(int frameNumber) {
                 poolMutex.unlock();
             }
 
-            for (int imageY = startY; imageY < std::min(startY + bucketSize, imageHeight); ++imageY) {
-                for (int imageX = startX; imageX < std::min(startX + bucketSize, imageWidth); ++imageX) {
-                    Vector3 finalColor = Vector3(0, 0, 0);
-                    for (int rayNumber = 0; rayNumber < RAYS_PER_PIXEL; rayNumber++) {
-                        float randomX = ((float)rand() / (RAND_MAX)) + imageX;
-                        float randomY = ((float)rand() / (RAND_MAX)) + imageY;
-
-                        float x = randomX / imageWidth;  // from 0 to 1
-                        float y = randomY / imageHeight; // from 0 to 1
-
-                        x = (2.0f * x) - 1.0f; // from -1 to 1
-                        y = 1.0f - (2.0f * y); // from -1 to 1
+            int endY = std::min(startY + bucketSize, imageHeight);
+            int endX = std::min(startX + bucketSize, imageWidth);
 
-                        float aspectRatio = (float)imageWidth / (float)imageHeight;
-                        x *= aspectRatio; // from -ar to ar
+            if (raySortingOn) {
+                RenderBucketSorted(startX, startY, endX, endY, pathBuffers);
+            }
+            else if (packetTracingOn) {
+                // Camera rays of RAY_PACKET_SIDE x RAY_PACKET_SIDE pixels are traced together, one packet per sample
+                for (int tileY = startY; tileY < endY; tileY += RAY_PACKET_SIDE) {
+                    for (int tileX = startX; tileX < endX; tileX += RAY_PACKET_SIDE) {
+                        Vector3 finalColors[RAY_PACKET_SIZE];
+                        for (int rayNumber = 0; rayNumber < RAYS_PER_PIXEL; rayNumber++) {
+                            RayPacket packet = CameraPacket(tileX, tileY, endX, endY);
+                            Intersection packetIntersections[RAY_PACKET_SIZE];
+                            PacketIntersection(packet, true, packetIntersections);
+                            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                                if (packet.activeMask & (1 << lane)) {
+                                    finalColors[lane] = finalColors[lane] + ShadeRay(cameraPosition, packet.rays[lane].direction, packetIntersections[lane], MAXIMUM_RAY_BOUNCES_COUNT, true);
+                                }
+                            }
+                        }
 
-                        Vector3 color = RayTrace(x, y);
-                        //color = Vector3((float)pow(color.r, 2.2), (float)pow(color.g, 2.2), (float)pow(color.b, 2.2)); // gamma correction;
-                        finalColor = finalColor + color;
+                        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                            int imageX = tileX + lane % RAY_PACKET_SIDE;
+                            int imageY = tileY + lane / RAY_PACKET_SIDE;
+                            if (imageX < endX && imageY < endY) {
+                                imageBuffer[imageY][imageX] = finalColors[lane] / (float)RAYS_PER_PIXEL;
+                            }
+                        }
                     }
+                }
+            }
+            else {
+                for (int imageY = startY; imageY < endY; ++imageY) {
+                    for (int imageX = startX; imageX < endX; ++imageX) {
+                        Vector3 finalColor = Vector3(0, 0, 0);
+                        for (int rayNumber = 0; rayNumber < RAYS_PER_PIXEL; rayNumber++) {
+                            float randomX = ((float)rand() / (RAND_MAX)) + imageX;
+                            float randomY = ((float)rand() / (RAND_MAX)) + imageY;
+
+                            Vector3 color = RayTrace(randomX, randomY);
+                            //color = Vector3((float)pow(color.r, 2.2), (float)pow(color.g, 2.2), (float)pow(color.b, 2.2)); // gamma correction;
+                            finalColor = finalColor + color;
+                        }
 
-                    imageBuffer[imageY][imageX] = finalColor / (float)RAYS_PER_PIXEL;
+                        imageBuffer[imageY][imageX] = finalColor / (float)RAYS_PER_PIXEL;
+                    }
                 }
             }
         }
@@ -259,31 +1044,143 @@ void Scene::renderFrame(int frameNumber) {
     for (auto& thread : threads) {
         thread.join();
     }
+}
 
-    std::stringstream ss;
-    ss << std::setw(4) << std::setfill('0') << frameNumber;
-    std::string fileName = "output/frame_" + ss.str() + ".ppm";
+// Appends the object's vertices and triangles to the mesh's buffers, sceneObject records where they went
+bool Scene::parseSceneObject(const rapidjson::Value& object, Mesh& mesh, SceneObject& sceneObject) {
+    if (object.HasMember("material_index")) {
+        sceneObject.materialIndex = object["material_index"].GetInt();
+    }
+    else {
+        sceneObject.materialIndex = 0;
+    }
+    if (!object.HasMember("vertices") || !object["vertices"].IsArray() ||
+        !object.HasMember("triangles") || !object["triangles"].IsArray()) {
+        return false;
+    }
 
-    std::ofstream ppmFileStream(fileName, std::ios::out | std::ios::binary);
-    if (!ppmFileStream.is_open()) {
-        std::cerr << "Could not open the file!" << std::endl;
+    sceneObject.firstVertex = (int)mesh.vertices.size();
+    const rapidjson::Value& verticesArray = object["vertices"];
+    for (rapidjson::SizeType j = 0; j < verticesArray.Size(); j += 3) {
+        mesh.vertices.push_back(Vector3(verticesArray[j].GetFloat(), verticesArray[j + 1].GetFloat(), verticesArray[j + 2].GetFloat()));
+    }
+    sceneObject.vertexCount = (int)mesh.vertices.size() - sceneObject.firstVertex;
+
+    // Vertices without a UV get a zero one
+    if (object.HasMember("uvs") && object["uvs"].IsArray()) {
+        const rapidjson::Value& uvArray = object["uvs"];
+        for (rapidjson::SizeType j = 0; j < uvArray.Size() && mesh.vertexUVs.size() < mesh.vertices.size(); j += 3) {
+            mesh.vertexUVs.push_back(Vector3(uvArray[j].GetFloat(), uvArray[j + 1].GetFloat(), uvArray[j + 2].GetFloat()));
+        }
+    }
+    mesh.vertexUVs.resize(mesh.vertices.size(), Vector3());
+
+    sceneObject.firstTriangle = mesh.triangleCount();
+    const rapidjson::Value& trianglesArray = object["triangles"];
+    for (rapidjson::SizeType j = 0; j + 2 < trianglesArray.Size(); j += 3) {
+        mesh.indexedTriangles.push_back(IndexedTriangle(
+            sceneObject.firstVertex + trianglesArray[j].GetInt(),
+            sceneObject.firstVertex + trianglesArray[j + 1].GetInt(),
+            sceneObject.firstVertex + trianglesArray[j + 2].GetInt(),
+            sceneObject.materialIndex
+        ));
+    }
+    sceneObject.triangleCount = mesh.triangleCount() - sceneObject.firstTriangle;
+
+    mesh.computeVertexNormals(sceneObject.firstTriangle, mesh.triangleCount(), sceneObject.firstVertex, (int)mesh.vertices.size());
+    return true;
+}
+
+std::vector<Vector3> Scene::objectVertices(int objectIndex) const {
+    const SceneObject& object = objects[objectIndex];
+    return std::vector<Vector3>(worldMesh.vertices.begin() + object.firstVertex, worldMesh.vertices.begin() + object.firstVertex + object.vertexCount);
+}
+
+// Moves the object's vertices in place, the triangles sharing them follow with the next refitAccTree
+void Scene::updateObjectVertices(int objectIndex, const std::vector<Vector3>& vertices) {
+    const SceneObject& object = objects[objectIndex];
+    if ((int)vertices.size() != object.vertexCount) {
+        std::cerr << "Vertex count of object " << objectIndex << " does not match!" << std::endl;
         return;
     }
 
-    // Init ppm
-    ppmFileStream << "P3\n" << imageWidth << " " << imageHeight << "\n" << MAX_COLOR_COMPONENT << "\n";
+    std::copy(vertices.begin(), vertices.end(), worldMesh.vertices.begin() + object.firstVertex);
+    worldMesh.computeVertexNormals(object.firstTriangle, object.firstTriangle + object.triangleCount, object.firstVertex, object.firstVertex + object.vertexCount);
+}
 
-    for (int imageY = 0; imageY < imageHeight; ++imageY) {
-        for (int imageX = 0; imageX < imageWidth; ++imageX) {
-            ppmFileStream << colorToPPMFormat(imageBuffer[imageY][imageX]);
-            if (imageX < imageWidth - 1) {
-                ppmFileStream << " ";
+void Scene::refitAccTree() {
+    auto refitStart = std::chrono::high_resolution_clock::now();
+    float degradation;
+    bool rebuilt = worldMesh.refitAccTree(accTreeBuilder, spatialSplitBudget, accTreeLeafSize, accTreeOptimizationPasses, accTreeLayout, accTreeBuildArena, degradation);
+    auto refitStop = std::chrono::high_resolution_clock::now();
+    if (!IsBVHLayout(accTreeLayout)) {
+        std::cout << (accTreeLayout == TwoLevelGrid ? "Grid" : "Kd-tree") << " rebuilt in: " << std::chrono::duration_cast<std::chrono::milliseconds>(refitStop - refitStart).count() << " ms" << std::endl;
+        return;
+    }
+    std::cout << "Acceleration tree " << (rebuilt ? "rebuilt" : "refitted") << " in: " << std::chrono::duration_cast<std::chrono::milliseconds>(refitStop - refitStart).count() << " ms (SAH cost " << std::fixed << std::setprecision(2) << degradation << "x of the built tree)" << std::endl;
+}
+
+// Renders a downscaled sample of the loaded scene with every tree layout and leaf size in ACC_TREE_TUNING_LEAF_SIZES
+// and reports the fastest combination. The scene's own settings are restored afterwards
+void Scene::tuneAccTree() {
+    const AccTreeLayout layouts[] = { BVH2, BVH4, BVH8, CompressedBVH4, CompressedBVH8, KDTreeSAH, TwoLevelGrid };
+    int sceneImageWidth = imageWidth;
+    int sceneImageHeight = imageHeight;
+    int sceneLeafSize = accTreeLeafSize;
+    AccTreeLayout sceneLayout = accTreeLayout;
+
+    auto rebuildAccTrees = [this](AccTreeLayout layout) {
+        worldMesh.rebuildAccTree(accTreeBuilder, spatialSplitBudget, accTreeLeafSize, accTreeOptimizationPasses, layout, accTreeBuildArena);
+        for (auto& mesh : meshes) {
+            mesh.rebuildAccTree(accTreeBuilder, spatialSplitBudget, accTreeLeafSize, accTreeOptimizationPasses, layout, accTreeBuildArena);
+        }
+    };
+
+    imageWidth = std::max(1, imageWidth / ACC_TREE_TUNING_SAMPLE_DIVISOR);
+    imageHeight = std::max(1, imageHeight / ACC_TREE_TUNING_SAMPLE_DIVISOR);
+    std::cout << "Tuning the acceleration tree on a " << imageWidth << "x" << imageHeight << " sample" << std::endl;
+
+    long long bestTime = std::numeric_limits<long long>::max();
+    int bestLeafSize = sceneLeafSize;
+    AccTreeLayout bestLayout = sceneLayout;
+    for (int leafSize : ACC_TREE_TUNING_LEAF_SIZES) {
+        accTreeLeafSize = leafSize;
+        // Built with a BVH layout so the binary tree exists, the loop below collapses it into each layout
+        rebuildAccTrees(BVH2);
+
+        for (AccTreeLayout layout : layouts) {
+            // The kd-tree and the grid do not depend on the leaf size
+            if (!IsBVHLayout(layout) && leafSize != ACC_TREE_TUNING_LEAF_SIZES[0]) continue;
+            accTreeLayout = layout;
+            worldMesh.buildTraversedAccTree(accTreeLayout);
+            for (auto& mesh : meshes) {
+                mesh.buildTraversedAccTree(accTreeLayout);
+            }
+
+            // The fastest of several runs, single runs are too noisy to compare
+            long long time = std::numeric_limits<long long>::max();
+            for (int run = 0; run < ACC_TREE_TUNING_RUNS; run++) {
+                auto renderStart = std::chrono::high_resolution_clock::now();
+                RenderImage();
+                auto renderStop = std::chrono::high_resolution_clock::now();
+                time = std::min(time, (long long)std::chrono::duration_cast<std::chrono::microseconds>(renderStop - renderStart).count());
+            }
+            std::cout << "  leaf size " << leafSize << ", " << AccTreeLayoutName(layout) << ": " << std::fixed << std::setprecision(2) << time / 1000.0 << " ms" << std::endl;
+
+            if (time < bestTime) {
+                bestTime = time;
+                bestLeafSize = leafSize;
+                bestLayout = layout;
             }
         }
-        ppmFileStream << "\n";
     }
+    std::cout << "Fastest: \"acc_tree_layout\": \"" << AccTreeLayoutName(bestLayout) << "\", \"acc_tree_leaf_size\": " << bestLeafSize << std::endl;
 
-    ppmFileStream.close();
+    imageWidth = sceneImageWidth;
+    imageHeight = sceneImageHeight;
+    accTreeLeafSize = sceneLeafSize;
+    accTreeLayout = sceneLayout;
+    rebuildAccTrees(accTreeLayout);
 }
 
 void Scene::loadScene(const std::string& filename) {
@@ -323,6 +1220,58 @@ void Scene::loadScene(const std::string& filename) {
         globalIluminationOn = false;
     }
 
+    accTreeBuilder = BinnedSAH;
+    if (document.HasMember("settings") && document["settings"].HasMember("acc_tree_builder")) {
+        std::string builderName = document["settings"]["acc_tree_builder"].GetString();
+        if (builderName == "median") accTreeBuilder = MedianSplit;
+        else if (builderName == "sah") accTreeBuilder = BinnedSAH;
+        else if (builderName == "sbvh") accTreeBuilder = SpatialSplitSAH;
+        else throw "Unknown acceleration tree builder";
+    }
+
+    spatialSplitBudget = SBVH_DUPLICATION_BUDGET;
+    if (document.HasMember("settings") && document["settings"].HasMember("sbvh_budget")) {
+        spatialSplitBudget = document["settings"]["sbvh_budget"].GetFloat();
+    }
+
+    accTreeLeafSize = ACC_TREE_LEAF_SIZE;
+    if (document.HasMember("settings") && document["settings"].HasMember("acc_tree_leaf_size")) {
+        accTreeLeafSize = document["settings"]["acc_tree_leaf_size"].GetInt();
+    }
+
+    accTreeOptimizationPasses = ACC_TREE_OPTIMIZATION_PASSES;
+    if (document.HasMember("settings") && document["settings"].HasMember("acc_tree_optimization_passes")) {
+        accTreeOptimizationPasses = document["settings"]["acc_tree_optimization_passes"].GetInt();
+    }
+
+    accTreeLayout = DEFAULT_ACC_TREE_LAYOUT;
+    if (document.HasMember("settings") && document["settings"].HasMember("acc_tree_layout")) {
+        std::string layoutName = document["settings"]["acc_tree_layout"].GetString();
+        if (layoutName == "bvh2") accTreeLayout = BVH2;
+        else if (layoutName == "bvh4") accTreeLayout = BVH4;
+        else if (layoutName == "bvh8") accTreeLayout = BVH8;
+        else if (layoutName == "bvh4q") accTreeLayout = CompressedBVH4;
+        else if (layoutName == "bvh8q") accTreeLayout = CompressedBVH8;
+        else if (layoutName == "kdtree") accTreeLayout = KDTreeSAH;
+        else if (layoutName == "grid") accTreeLayout = TwoLevelGrid;
+        else throw "Unknown acceleration tree layout";
+    }
+
+    accTreeCacheOn = ACC_TREE_CACHE_ON;
+    if (document.HasMember("settings") && document["settings"].HasMember("acc_tree_cache")) {
+        accTreeCacheOn = document["settings"]["acc_tree_cache"].GetBool();
+    }
+
+    packetTracingOn = PACKET_TRACING_ON;
+    if (document.HasMember("settings") && document["settings"].HasMember("packet_tracing")) {
+        packetTracingOn = document["settings"]["packet_tracing"].GetBool();
+    }
+
+    raySortingOn = RAY_SORTING_ON;
+    if (document.HasMember("settings") && document["settings"].HasMember("ray_sorting")) {
+        raySortingOn = document["settings"]["ray_sorting"].GetBool();
+    }
+
     if (document.HasMember("camera")) {
         const auto& camera = document["camera"];
         if (camera.HasMember("position")) {
@@ -446,93 +1395,129 @@ void Scene::loadScene(const std::string& filename) {
         materials.push_back(Material(diffuse, Texture::CreateAlbedoTexture("", Vector3(.5f, .5f, .5f)), 1.0f, false));
     }
 
-    triangles.clear();
+    worldMesh.clearGeometry();
+    objects.clear();
     if (document.HasMember("objects") && document["objects"].IsArray()) {
-        const rapidjson::Value& objects = document["objects"];
-        for (rapidjson::SizeType i = 0; i < objects.Size(); ++i) {
-            const rapidjson::Value& object = objects[i];
-            int materialIndex = -1;
-            if (object.HasMember("material_index")) {
-                materialIndex = object["material_index"].GetInt();
-            }
-            else {
-                materialIndex = 0;
+        const rapidjson::Value& objectsArray = document["objects"];
+        for (rapidjson::SizeType i = 0; i < objectsArray.Size(); ++i) {
+            SceneObject sceneObject;
+            if (parseSceneObject(objectsArray[i], worldMesh, sceneObject)) {
+                objects.push_back(sceneObject);
             }
-            if (object.HasMember("vertices") && object["vertices"].IsArray() &&
-                object.HasMember("triangles") && object["triangles"].IsArray()) {
-
-                std::vector<Vector3> vertices;
-                const rapidjson::Value& verticesArray = object["vertices"];
-                for (rapidjson::SizeType j = 0; j < verticesArray.Size(); j += 3) {
-                    vertices.push_back(Vector3(verticesArray[j].GetFloat(), verticesArray[j + 1].GetFloat(), verticesArray[j + 2].GetFloat()));
-                }
-
-                std::vector<Vector3> vertexUVs;
-                if (object.HasMember("uvs") && object["uvs"].IsArray()) {
-                    const rapidjson::Value& uvArray = object["uvs"];
-                    for (rapidjson::SizeType j = 0; j < uvArray.Size(); j += 3) {
-                        vertexUVs.push_back(Vector3(uvArray[j].GetFloat(), uvArray[j + 1].GetFloat(), uvArray[j + 2].GetFloat()));
-                    }
-                }
-
-                std::vector<Vector3> vertexNormals(vertices.size(), Vector3(0, 0, 0));
+        }
+    }
 
-                const rapidjson::Value& trianglesArray = object["triangles"];
-                for (rapidjson::SizeType j = 0; j < trianglesArray.Size(); j += 3) {
-                    int indexA = trianglesArray[j].GetInt();
-                    int indexB = trianglesArray[j + 1].GetInt();
-                    int indexC = trianglesArray[j + 2].GetInt();
+    // Meshes have the same format as objects but are only rendered through instances.
+    // Existing meshes are reused so reloading keeps their allocations
+    size_t meshCount = document.HasMember("meshes") && document["meshes"].IsArray() ? document["meshes"].Size() : 0;
+    meshes.resize(meshCount);
+    for (size_t i = 0; i < meshCount; ++i) {
+        SceneObject meshObject;
+        meshes[i].clearGeometry();
+        parseSceneObject(document["meshes"][(rapidjson::SizeType)i], meshes[i], meshObject);
+    }
 
-                    Vector3 vertexA = vertices[indexA];
-                    Vector3 vertexB = vertices[indexB];
-                    Vector3 vertexC = vertices[indexC];
+    auto buildStart = std::chrono::high_resolution_clock::now();
+    std::vector<Mesh*> allMeshes = { &worldMesh };
+    size_t uniqueTriangleCount = worldMesh.triangleCount();
+    for (auto& mesh : meshes) {
+        allMeshes.push_back(&mesh);
+        uniqueTriangleCount += mesh.triangleCount();
+    }
+    std::vector<const Mesh*> allConstMeshes(allMeshes.begin(), allMeshes.end());
 
-                    Vector3 edge1 = vertexB - vertexA;
-                    Vector3 edge2 = vertexC - vertexA;
-                    Vector3 faceNormal = edge1.cross(edge2).normalize();
+    size_t largestTriangleCount = 0;
+    for (const Mesh* mesh : allMeshes) {
+        largestTriangleCount = std::max(largestTriangleCount, (size_t)mesh->triangleCount());
+    }
+    size_t instanceCount = document.HasMember("instances") && document["instances"].IsArray() ? document["instances"].Size() : 0;
+    accTreeBuildArena.releaseIfOversized(std::max(largestTriangleCount, instanceCount));
+
+    // The cache holds the binary BVH, the kd-tree and the grid are built without one
+    bool bvhLayout = IsBVHLayout(accTreeLayout);
+    bool loadedFromCache = false;
+    uint64_t accTreeHash = 0;
+    std::string accTreeCachePath = filename + ACC_TREE_CACHE_EXTENSION;
+    if (accTreeCacheOn && bvhLayout) {
+        accTreeHash = AccTreeCache::Hash(allConstMeshes, accTreeBuilder, spatialSplitBudget, accTreeLeafSize, accTreeOptimizationPasses);
+        loadedFromCache = AccTreeCache::Load(accTreeCachePath, accTreeHash, allMeshes);
+    }
 
-                    vertexNormals[indexA] = vertexNormals[indexA] + faceNormal;
-                    vertexNormals[indexB] = vertexNormals[indexB] + faceNormal;
-                    vertexNormals[indexC] = vertexNormals[indexC] + faceNormal;
-                }
+    for (size_t i = 0; i < allMeshes.size(); i++) {
+        Mesh* mesh = allMeshes[i];
+        if (!bvhLayout) {
+            mesh->clearBinaryAccTree();
+        }
+        if (loadedFromCache || !bvhLayout) {
+            mesh->buildTraversedAccTree(accTreeLayout);
+            continue;
+        }
 
-                for (size_t j = 0; j < vertices.size(); ++j) {
-                    vertexNormals[j] = vertexNormals[j].normalize();
-                }
+        std::vector<Triangle> triangles = mesh->gatherTriangles();
+        mesh->accTree.build(triangles, accTreeBuilder, spatialSplitBudget, accTreeLeafSize, accTreeBuildArena);
+        if (accTreeOptimizationPasses > 0 && !mesh->accTree.nodes.empty()) {
+            auto optimizationStart = std::chrono::high_resolution_clock::now();
+            float sahCostBefore = mesh->accTree.sahCost();
+            mesh->accTree.optimize(accTreeOptimizationPasses);
+            auto optimizationStop = std::chrono::high_resolution_clock::now();
+            std::cout << "Acceleration tree of " << (i == 0 ? "the scene objects" : "mesh " + std::to_string(i - 1)) << " optimized in: " << std::chrono::duration_cast<std::chrono::milliseconds>(optimizationStop - optimizationStart).count() << " ms, SAH cost " << std::fixed << std::setprecision(2) << sahCostBefore << " -> " << mesh->accTree.sahCost() << std::endl;
+        }
+        mesh->accTree.builtSahCost = mesh->accTree.refitSahCost(triangles);
+        mesh->buildTraversedAccTree(accTreeLayout);
+    }
 
-                for (rapidjson::SizeType j = 0; j < trianglesArray.Size(); j += 3) {
-                    int indexA = trianglesArray[j].GetInt();
-                    int indexB = trianglesArray[j + 1].GetInt();
-                    int indexC = trianglesArray[j + 2].GetInt();
-
-                    Vector3 vertexAUV = indexA - 1 < vertexUVs.size() ? vertexUVs[indexA] : Vector3();
-                    Vector3 vertexBUV = indexB - 1 < vertexUVs.size() ? vertexUVs[indexB] : Vector3();
-                    Vector3 vertexCUV = indexC - 1 < vertexUVs.size() ? vertexUVs[indexC] : Vector3();
-
-                    Triangle triangle = Triangle(
-                        vertices[indexA],
-                        vertices[indexB],
-                        vertices[indexC],
-                        materialIndex,
-                        vertexNormals[indexA],
-                        vertexNormals[indexB],
-                        vertexNormals[indexC],
-                        vertexAUV,
-                        vertexBUV,
-                        vertexCUV
-                    );
-
-                    if (!materials[materialIndex].smoothShading) {
-                        triangle.vertexANormal = triangle.vertexBNormal = triangle.vertexCNormal = triangle.normal();
-                    }
+    if (accTreeCacheOn && bvhLayout && !loadedFromCache && !AccTreeCache::Save(accTreeCachePath, accTreeHash, allConstMeshes)) {
+        std::cerr << "Could not write the acceleration tree cache!" << std::endl;
+    }
 
-                    triangles.push_back(triangle);
-                }
+    instances.clear();
+    size_t placedTriangleCount = worldMesh.triangleCount();
+    if (document.HasMember("instances") && document["instances"].IsArray()) {
+        const rapidjson::Value& instancesArray = document["instances"];
+        for (rapidjson::SizeType i = 0; i < instancesArray.Size(); ++i) {
+            const rapidjson::Value& instance = instancesArray[i];
+            int meshIndex = instance["mesh"].GetInt();
+            if (meshIndex < 0 || meshIndex >= (int)meshes.size()) throw "Unknown instance mesh";
+
+            Vector3 position = Vector3(0, 0, 0);
+            if (instance.HasMember("position")) {
+                const auto& positionArray = instance["position"].GetArray();
+                position = Vector3(positionArray[0].GetFloat(), positionArray[1].GetFloat(), positionArray[2].GetFloat());
+            }
+            Matrix3x3 transform = Matrix3x3(1, 0, 0, 0, 1, 0, 0, 0, 1);
+            if (instance.HasMember("matrix")) {
+                const auto& matrix = instance["matrix"].GetArray();
+                transform = Matrix3x3(
+                    matrix[0].GetFloat(), matrix[1].GetFloat(), matrix[2].GetFloat(),
+                    matrix[3].GetFloat(), matrix[4].GetFloat(), matrix[5].GetFloat(),
+                    matrix[6].GetFloat(), matrix[7].GetFloat(), matrix[8].GetFloat()
+                );
             }
+
+            if (meshes[meshIndex].indexedTriangles.empty()) continue;
+            instances.push_back(Instance(meshIndex, transform, position, meshes[meshIndex].bounds()));
+            placedTriangleCount += meshes[meshIndex].triangleCount();
         }
     }
 
-    if (!triangles.empty()) {
-        rootAABB = AABB::BuildAccTree(0, triangles);
+    std::vector<AABB> instanceBounds;
+    for (const auto& instance : instances) {
+        instanceBounds.push_back(instance.bounds);
+    }
+    instanceTree.build(instanceBounds, accTreeBuilder, accTreeBuildArena);
+    auto buildStop = std::chrono::high_resolution_clock::now();
+    std::cout << "Acceleration tree for " << uniqueTriangleCount << " triangles " << (loadedFromCache ? "loaded from cache" : "built") << " in: " << std::chrono::duration_cast<std::chrono::milliseconds>(buildStop - buildStart).count() << " ms";
+    if (!instances.empty()) {
+        std::cout << " (" << instances.size() << " instances, " << placedTriangleCount << " placed triangles)";
+    }
+    std::cout << std::endl;
+
+    size_t nodeCount = 0;
+    size_t nodeBytes = 0;
+    for (const Mesh* mesh : allMeshes) {
+        std::pair<size_t, size_t> nodeStats = mesh->accTreeNodeStats(accTreeLayout);
+        nodeCount += nodeStats.first;
+        nodeBytes = nodeStats.second;
     }
+    std::cout << "Acceleration tree nodes: " << nodeCount << " x " << nodeBytes << " bytes = " << std::fixed << std::setprecision(2) << nodeCount * nodeBytes / (1024.0 * 1024.0) << " MB" << std::endl;
 }
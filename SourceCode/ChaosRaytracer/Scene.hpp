@@ -10,17 +10,25 @@
 #include <thread>
 #include <cmath>
 #include <limits>
+#include <chrono>
+#include <bit>
 
 #include "include/rapidjson/document.h"
 
 #include "Vector3.hpp"
 #include "Matrix3x3.hpp"
+#include "Ray.hpp"
+#include "RayPacket.hpp"
+#include "Path.hpp"
 #include "Light.hpp"
 #include "Triangle.hpp"
+#include "SceneObject.hpp"
+#include "Mesh.hpp"
+#include "Instance.hpp"
+#include "AccTreeCache.hpp"
 #include "Material.hpp"
 #include "Constants.hpp"
 #include "Texture.hpp"
-#include "AABB.hpp"
 
 class Scene {
 public:
@@ -28,10 +36,15 @@ public:
 
     Vector3 cameraPosition;
     Matrix3x3 cameraRotation;
-    std::vector<Triangle> triangles;
+    Mesh worldMesh;                  // vertices and triangles of all scene objects, in world space
+    std::vector<SceneObject> objects;
 
     void loadScene(const std::string& filename);
     void renderFrame(int frameNumber);
+    std::vector<Vector3> objectVertices(int objectIndex) const;
+    void updateObjectVertices(int objectIndex, const std::vector<Vector3>& vertices);
+    void refitAccTree();
+    void tuneAccTree();
 
 private:
     Vector3 defaultColor;
@@ -46,15 +59,53 @@ private:
     int bucketSize;
     int rowsCompleted;
     bool globalIluminationOn;
-    AABB rootAABB;
+    AccTreeBuilder accTreeBuilder;
+    float spatialSplitBudget;
+    int accTreeLeafSize;
+    int accTreeOptimizationPasses;
+    AccTreeLayout accTreeLayout;
+    bool accTreeCacheOn;
+    bool packetTracingOn;
+    bool raySortingOn;
+    AABB raySortingBounds;
+    std::vector<Mesh> meshes;        // shared geometry placed by instances
+    std::vector<Instance> instances;
+    BVH instanceTree;                // top level tree, leaves index instances
+    BVH::BuildArena accTreeBuildArena; // build scratch memory shared by all trees, reused on reloads of scenes of a similar size
 
-    Intersection WorldIntersection(const Vector3 ray, const Vector3 position, bool backfaceCullingON);
-    Intersection TraverseKDTree(const AABB& node, const Vector3& ray, const Vector3& position, bool backfaceCullingON);
+    Intersection WorldIntersection(const Ray& ray, bool backfaceCullingON);
+    void MeshIntersection(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    void TraverseBVH(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit, int rootNodeIndex = 0);
+    void PacketIntersection(RayPacket& packet, bool backfaceCullingON, Intersection* closestIntersections);
+    void TraverseBVHPacket(const Mesh& mesh, RayPacket& packet, bool backfaceCullingON, RayHit* closestHits);
+    void TraverseInstances(const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    bool WorldOcclusion(const Ray& ray, float maxDistance);
+    bool MeshOcclusion(const Mesh& mesh, const Ray& ray, float maxDistance);
+    bool TraverseBVHAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance);
+    bool TraverseInstancesAnyHit(const Ray& ray, float maxDistance);
+    void TraverseKDTree(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    bool TraverseKDTreeAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance);
+    void TraverseGrid(const Mesh& mesh, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    bool TraverseGridAnyHit(const Mesh& mesh, const Ray& ray, float maxDistance);
+    template <typename WideTree> void TraverseWideBVH(const Mesh& mesh, const WideTree& tree, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    template <typename WideTree> bool TraverseWideBVHAnyHit(const Mesh& mesh, const WideTree& tree, const Ray& ray, float maxDistance);
+    void IntersectLeaf(const Mesh& mesh, int firstTriangle, int triangleCount, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    void IntersectTriangle(const Mesh& mesh, int triangleIndex, const Ray& ray, bool backfaceCullingON, RayHit& closestHit);
+    Intersection ResolveHit(const RayHit& hit);
+    bool OccludedByLeaf(const Mesh& mesh, int firstTriangle, int triangleCount, const Ray& ray, float maxDistance);
     Vector3 Refract(const Vector3& incident, const Vector3& normal, float eta);
     float Fresnel(const Vector3& incident, const Vector3& normal, float ior);
-    Vector3 Diffuse(Vector3& intersectionPoint, Vector3& surfaceNormal);
-    Vector3 RayTrace(float imageX, float imageY);
+    Vector3 Diffuse(const Vector3& intersectionPoint, const Vector3& surfaceNormal);
+    Vector3 PrimaryRayDirection(float pixelX, float pixelY);
+    Vector3 RayTrace(float pixelX, float pixelY);
     Vector3 RayTraceRay(const Vector3& origin, const Vector3& ray, int maxBounces, bool backfaceCullingON);
+    Vector3 ShadeRay(const Vector3& origin, const Vector3& ray, Intersection intersection, int maxBounces, bool backfaceCullingON);
+    bool ShadeBounce(Path& path, const Intersection& intersection, bool backfaceCullingON);
+    RayPacket CameraPacket(int tileX, int tileY, int endX, int endY);
+    uint32_t RayOrderKey(const Vector3& origin, const Vector3& direction) const;
+    void RenderImage();
+    void RenderBucketSorted(int startX, int startY, int endX, int endY, PathBuffers& buffers);
+    bool parseSceneObject(const rapidjson::Value& object, Mesh& mesh, SceneObject& sceneObject);
     int colorFromDecimalToWholeRepresentation(float value);
     std::string colorToPPMFormat(Vector3 color);
 };
@@ -0,0 +1,12 @@
+#pragma once
+
+// Where the geometry of one scene object lives in the world mesh, kept so its vertices can be moved later
+struct SceneObject {
+	int materialIndex;
+	int firstTriangle;
+	int triangleCount;
+	int firstVertex;
+	int vertexCount;
+
+	SceneObject() : materialIndex(0), firstTriangle(0), triangleCount(0), firstVertex(0), vertexCount(0) {}
+};
@@ -2,26 +2,18 @@
 
 #include "Vector3.hpp"
 #include "Intersection.hpp"
+#include "Ray.hpp"
 
+// Positions only, all the tree builders and the intersection records need. Gathered from a mesh's vertex buffers when a tree is built
 struct Triangle {
     Vector3 vertexA;
     Vector3 vertexB;
     Vector3 vertexC;
-    Vector3 vertexANormal;
-    Vector3 vertexBNormal;
-    Vector3 vertexCNormal;
-    Vector3 vertexAUV;
-    Vector3 vertexBUV;
-    Vector3 vertexCUV;
-    int materialIndex;
 
-    Triangle(Vector3 _vertexA, Vector3 _vertexB, Vector3 _vertexC, int _materialIndex, Vector3 _vertexANormal, Vector3 _vertexBNormal, Vector3 _vertexCNormal, Vector3 _vertexAUV, Vector3 _vertexBUV, Vector3 _vertexCUV)
-        : vertexA(_vertexA), vertexB(_vertexB), vertexC(_vertexC), materialIndex(_materialIndex), vertexANormal(_vertexANormal), vertexBNormal(_vertexBNormal), vertexCNormal(_vertexCNormal), vertexAUV(_vertexAUV), vertexBUV(_vertexBUV), vertexCUV(_vertexCUV) {}
+    Triangle(Vector3 _vertexA, Vector3 _vertexB, Vector3 _vertexC) : vertexA(_vertexA), vertexB(_vertexB), vertexC(_vertexC) {}
 
 
     inline Vector3 normal() const { return (vertexB - vertexA).cross(vertexC - vertexA).normalize(); }
-
-    inline Vector3 hitNormal(float u, float v) const { return (vertexBNormal * u + vertexCNormal * v + vertexANormal * (1 - u - v)).normalize(); }
     
     inline Vector3 centroid() const { return (vertexA + vertexB + vertexC) / 3.0f; }
 
@@ -31,61 +23,54 @@ struct Triangle {
         Vector3 vectorAC = vertexC - vertexA;
         return 0.5f * vectorAB.cross(vectorAC).length();
     }
+};
 
-    Intersection intersect(Vector3 ray, Vector3 cameraPosition, bool backfaceCullingON) const {
-        Intersection intersection = Intersection();
-
-        Vector3 translatedPointA = vertexA - cameraPosition;
-        Vector3 translatedPointB = vertexB - cameraPosition;
-        Vector3 translatedPointC = vertexC - cameraPosition;
+// A triangle of a mesh as indices into the mesh's shared vertex buffers, so vertices used by several triangles are stored once
+struct IndexedTriangle {
+    int vertexA;
+    int vertexB;
+    int vertexC;
+    int materialIndex;
 
-        Vector3 E0 = translatedPointB - translatedPointA;
-        Vector3 E1 = translatedPointC - translatedPointB;
-        Vector3 E2 = translatedPointA - translatedPointC;
-        Vector3 normal = E0.cross(E1);
+    IndexedTriangle(int _vertexA, int _vertexB, int _vertexC, int _materialIndex) : vertexA(_vertexA), vertexB(_vertexB), vertexC(_vertexC), materialIndex(_materialIndex) {}
+};
 
-        float dotOfRayAndNormal = ray.dot(normal);
-        if (dotOfRayAndNormal == 0) {
-            return intersection;
+// What the intersection test needs of a triangle, set up once when the triangles are loaded or changed instead of on every test
+struct TriangleRecord {
+    Vector3 vertexA;
+    Vector3 edgeAB;
+    Vector3 edgeAC;
+
+    TriangleRecord(const Triangle& triangle) : vertexA(triangle.vertexA), edgeAB(triangle.vertexB - triangle.vertexA), edgeAC(triangle.vertexC - triangle.vertexA) {}
+
+    // Moller-Trumbore: solves origin + distance * direction = A + u * AB + v * AC with one division and no square roots.
+    // Only hits in [0, maxDistance) strictly inside the triangle count, backfaces are the ones with a non positive determinant
+    inline bool intersect(const Ray& ray, bool backfaceCullingON, float maxDistance, float& distance, float& u, float& v) const {
+        Vector3 directionCrossAC = ray.direction.cross(edgeAC);
+        float determinant = edgeAB.dot(directionCrossAC);
+        if (backfaceCullingON ? !(determinant > 0) : determinant == 0) {
+            return false;
         }
+        float inverseDeterminant = 1.0f / determinant;
 
-        float dotToPlane = translatedPointA.dot(normal);
-        if (backfaceCullingON && dotToPlane >= 0) {
-            return intersection;
+        Vector3 fromA = ray.origin - vertexA;
+        u = fromA.dot(directionCrossAC) * inverseDeterminant;
+        if (!(u > 0 && u < 1)) {
+            return false;
         }
 
-        float distance = dotToPlane / dotOfRayAndNormal;
-        if (distance < 0) {
-            return intersection;
+        Vector3 fromACrossAB = fromA.cross(edgeAB);
+        v = ray.direction.dot(fromACrossAB) * inverseDeterminant;
+        if (!(v > 0 && u + v < 1)) {
+            return false;
         }
 
-        Vector3 pointOfHit = ray * distance;
-
-        Vector3 V0P = pointOfHit - translatedPointA; // Vector from vertex A to point of hit
-        Vector3 V1P = pointOfHit - translatedPointB; // Vector from vertex B to point of hit
-        Vector3 V2P = pointOfHit - translatedPointC; // Vector from vertex C to point of hit
-
-        Vector3 V0V2 = translatedPointC - translatedPointA;
-        Vector3 V0V1 = translatedPointB - translatedPointA;
-
-        Vector3 C0 = E0.cross(V0P);
-        Vector3 C1 = E1.cross(V1P);
-        Vector3 C2 = E2.cross(V2P);
-
-        if (normal.dot(C0) > 0 && normal.dot(C1) > 0 && normal.dot(C2) > 0) {
-            float areaABC = V0V1.cross(V0V2).length();
-
-            intersection.uv.u = C2.length() / areaABC;
-            intersection.uv.v = C0.length() / areaABC;
-            intersection.uv.s = 1 - intersection.uv.u - intersection.uv.v;
-
-            intersection.interpolatedUV = vertexBUV * intersection.uv.u + vertexCUV * intersection.uv.v + vertexAUV * intersection.uv.s;
-
-            intersection.distance = distance;
-            intersection.type = Hit;
-            return intersection;
-        }
+        distance = edgeAC.dot(fromACrossAB) * inverseDeterminant;
+        return distance >= 0 && distance < maxDistance;
+    }
 
-        return intersection;
+    inline bool occludes(const Ray& ray, float maxDistance) const {
+        float distance, u, v;
+        return intersect(ray, false, maxDistance, distance, u, v);
     }
 };
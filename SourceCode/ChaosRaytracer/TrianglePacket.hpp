@@ -0,0 +1,164 @@
+#pragma once
+
+#include <limits>
+#include <bit>
+#include <immintrin.h>
+
+#include "Ray.hpp"
+#include "Triangle.hpp"
+
+#if defined(__AVX2__)
+const int TRIANGLE_PACKET_WIDTH = 8;
+#else
+const int TRIANGLE_PACKET_WIDTH = 4;
+#endif
+
+inline int TrianglePacketCount(int triangleCount) { return (triangleCount + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH; }
+
+// Intersection records of up to TRIANGLE_PACKET_WIDTH triangles of one leaf as SoA, so one ray is tested against all of them at once.
+// Unused lanes stay zero, a zero determinant never hits
+struct alignas(32) TrianglePacket {
+    float vertexAX[TRIANGLE_PACKET_WIDTH];
+    float vertexAY[TRIANGLE_PACKET_WIDTH];
+    float vertexAZ[TRIANGLE_PACKET_WIDTH];
+    float edgeABX[TRIANGLE_PACKET_WIDTH];
+    float edgeABY[TRIANGLE_PACKET_WIDTH];
+    float edgeABZ[TRIANGLE_PACKET_WIDTH];
+    float edgeACX[TRIANGLE_PACKET_WIDTH];
+    float edgeACY[TRIANGLE_PACKET_WIDTH];
+    float edgeACZ[TRIANGLE_PACKET_WIDTH];
+
+    TrianglePacket() {
+        for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+            vertexAX[lane] = vertexAY[lane] = vertexAZ[lane] = 0.0f;
+            edgeABX[lane] = edgeABY[lane] = edgeABZ[lane] = 0.0f;
+            edgeACX[lane] = edgeACY[lane] = edgeACZ[lane] = 0.0f;
+        }
+    }
+
+    void setTriangle(int lane, const TriangleRecord& record) {
+        vertexAX[lane] = record.vertexA.x;
+        vertexAY[lane] = record.vertexA.y;
+        vertexAZ[lane] = record.vertexA.z;
+        edgeABX[lane] = record.edgeAB.x;
+        edgeABY[lane] = record.edgeAB.y;
+        edgeABZ[lane] = record.edgeAB.z;
+        edgeACX[lane] = record.edgeAC.x;
+        edgeACY[lane] = record.edgeAC.y;
+        edgeACZ[lane] = record.edgeAC.z;
+    }
+
+    // TriangleRecord::intersect on all lanes. Returns the lane of the nearest hit in [0, maxDistance), the first one on ties, or -1
+    inline int intersect(const Ray& ray, bool backfaceCullingON, float maxDistance, float& distance, float& u, float& v) const {
+        alignas(32) float distances[TRIANGLE_PACKET_WIDTH];
+        alignas(32) float us[TRIANGLE_PACKET_WIDTH];
+        alignas(32) float vs[TRIANGLE_PACKET_WIDTH];
+        int hitMask = intersectLanes(ray, backfaceCullingON, maxDistance, distances, us, vs);
+
+        int nearestLane = -1;
+        while (hitMask) {
+            int lane = std::countr_zero((unsigned)hitMask);
+            hitMask &= hitMask - 1;
+            if (nearestLane == -1 || distances[lane] < distances[nearestLane]) {
+                nearestLane = lane;
+            }
+        }
+        if (nearestLane != -1) {
+            distance = distances[nearestLane];
+            u = us[nearestLane];
+            v = vs[nearestLane];
+        }
+        return nearestLane;
+    }
+
+    inline bool occludes(const Ray& ray, float maxDistance) const {
+        alignas(32) float distances[TRIANGLE_PACKET_WIDTH];
+        alignas(32) float us[TRIANGLE_PACKET_WIDTH];
+        alignas(32) float vs[TRIANGLE_PACKET_WIDTH];
+        return intersectLanes(ray, false, maxDistance, distances, us, vs) != 0;
+    }
+
+private:
+    // Moller-Trumbore on every lane, returns the mask of the lanes that hit
+    inline int intersectLanes(const Ray& ray, bool backfaceCullingON, float maxDistance, float* distances, float* us, float* vs) const {
+#if defined(__AVX2__)
+        __m256 directionX = _mm256_set1_ps(ray.direction.x);
+        __m256 directionY = _mm256_set1_ps(ray.direction.y);
+        __m256 directionZ = _mm256_set1_ps(ray.direction.z);
+        __m256 abX = _mm256_load_ps(edgeABX);
+        __m256 abY = _mm256_load_ps(edgeABY);
+        __m256 abZ = _mm256_load_ps(edgeABZ);
+        __m256 acX = _mm256_load_ps(edgeACX);
+        __m256 acY = _mm256_load_ps(edgeACY);
+        __m256 acZ = _mm256_load_ps(edgeACZ);
+
+        __m256 crossX = _mm256_sub_ps(_mm256_mul_ps(directionY, acZ), _mm256_mul_ps(directionZ, acY));
+        __m256 crossY = _mm256_sub_ps(_mm256_mul_ps(directionZ, acX), _mm256_mul_ps(directionX, acZ));
+        __m256 crossZ = _mm256_sub_ps(_mm256_mul_ps(directionX, acY), _mm256_mul_ps(directionY, acX));
+        __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(abX, crossX), _mm256_mul_ps(abY, crossY)), _mm256_mul_ps(abZ, crossZ));
+        __m256 inverseDeterminant = _mm256_div_ps(_mm256_set1_ps(1.0f), determinant);
+
+        __m256 fromAX = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_load_ps(vertexAX));
+        __m256 fromAY = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_load_ps(vertexAY));
+        __m256 fromAZ = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_load_ps(vertexAZ));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fromAX, crossX), _mm256_mul_ps(fromAY, crossY)), _mm256_mul_ps(fromAZ, crossZ)), inverseDeterminant);
+
+        __m256 fromACrossABX = _mm256_sub_ps(_mm256_mul_ps(fromAY, abZ), _mm256_mul_ps(fromAZ, abY));
+        __m256 fromACrossABY = _mm256_sub_ps(_mm256_mul_ps(fromAZ, abX), _mm256_mul_ps(fromAX, abZ));
+        __m256 fromACrossABZ = _mm256_sub_ps(_mm256_mul_ps(fromAX, abY), _mm256_mul_ps(fromAY, abX));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(directionX, fromACrossABX), _mm256_mul_ps(directionY, fromACrossABY)), _mm256_mul_ps(directionZ, fromACrossABZ)), inverseDeterminant);
+        __m256 distance = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(acX, fromACrossABX), _mm256_mul_ps(acY, fromACrossABY)), _mm256_mul_ps(acZ, fromACrossABZ)), inverseDeterminant);
+
+        __m256 zero = _mm256_setzero_ps();
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 valid = backfaceCullingON ? _mm256_cmp_ps(determinant, zero, _CMP_GT_OQ) : _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ);
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(u, one, _CMP_LT_OQ)));
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GT_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LT_OQ)));
+        valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(distance, zero, _CMP_GE_OQ), _mm256_cmp_ps(distance, _mm256_set1_ps(maxDistance), _CMP_LT_OQ)));
+
+        _mm256_store_ps(distances, distance);
+        _mm256_store_ps(us, u);
+        _mm256_store_ps(vs, v);
+        return _mm256_movemask_ps(valid);
+#else
+        __m128 directionX = _mm_set1_ps(ray.direction.x);
+        __m128 directionY = _mm_set1_ps(ray.direction.y);
+        __m128 directionZ = _mm_set1_ps(ray.direction.z);
+        __m128 abX = _mm_load_ps(edgeABX);
+        __m128 abY = _mm_load_ps(edgeABY);
+        __m128 abZ = _mm_load_ps(edgeABZ);
+        __m128 acX = _mm_load_ps(edgeACX);
+        __m128 acY = _mm_load_ps(edgeACY);
+        __m128 acZ = _mm_load_ps(edgeACZ);
+
+        __m128 crossX = _mm_sub_ps(_mm_mul_ps(directionY, acZ), _mm_mul_ps(directionZ, acY));
+        __m128 crossY = _mm_sub_ps(_mm_mul_ps(directionZ, acX), _mm_mul_ps(directionX, acZ));
+        __m128 crossZ = _mm_sub_ps(_mm_mul_ps(directionX, acY), _mm_mul_ps(directionY, acX));
+        __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(abX, crossX), _mm_mul_ps(abY, crossY)), _mm_mul_ps(abZ, crossZ));
+        __m128 inverseDeterminant = _mm_div_ps(_mm_set1_ps(1.0f), determinant);
+
+        __m128 fromAX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_load_ps(vertexAX));
+        __m128 fromAY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_load_ps(vertexAY));
+        __m128 fromAZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_load_ps(vertexAZ));
+        __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(fromAX, crossX), _mm_mul_ps(fromAY, crossY)), _mm_mul_ps(fromAZ, crossZ)), inverseDeterminant);
+
+        __m128 fromACrossABX = _mm_sub_ps(_mm_mul_ps(fromAY, abZ), _mm_mul_ps(fromAZ, abY));
+        __m128 fromACrossABY = _mm_sub_ps(_mm_mul_ps(fromAZ, abX), _mm_mul_ps(fromAX, abZ));
+        __m128 fromACrossABZ = _mm_sub_ps(_mm_mul_ps(fromAX, abY), _mm_mul_ps(fromAY, abX));
+        __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, fromACrossABX), _mm_mul_ps(directionY, fromACrossABY)), _mm_mul_ps(directionZ, fromACrossABZ)), inverseDeterminant);
+        __m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(acX, fromACrossABX), _mm_mul_ps(acY, fromACrossABY)), _mm_mul_ps(acZ, fromACrossABZ)), inverseDeterminant);
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 valid = backfaceCullingON ? _mm_cmpgt_ps(determinant, zero) : _mm_cmpneq_ps(determinant, zero);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, one)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(_mm_add_ps(u, v), one)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(distance, zero), _mm_cmplt_ps(distance, _mm_set1_ps(maxDistance))));
+
+        _mm_store_ps(distances, distance);
+        _mm_store_ps(us, u);
+        _mm_store_ps(vs, v);
+        return _mm_movemask_ps(valid);
+#endif
+    }
+};
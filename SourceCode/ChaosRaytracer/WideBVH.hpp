@@ -0,0 +1,216 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <immintrin.h>
+
+#include "Vector3.hpp"
+#include "Ray.hpp"
+#include "BVH.hpp"
+
+enum AccTreeLayout {
+    BVH2,
+    BVH4,
+    BVH8,
+    CompressedBVH4,
+    CompressedBVH8,
+    KDTreeSAH,      // not a BVH layout, the mesh is traversed through its kd-tree instead and no BVH is built
+    TwoLevelGrid    // not a BVH layout either, like the kd-tree it is rebuilt instead of refitted when the geometry changes
+};
+
+// Name of the layout in the acc_tree_layout setting
+inline const char* AccTreeLayoutName(AccTreeLayout layout) {
+    switch (layout) {
+    case BVH4: return "bvh4";
+    case BVH8: return "bvh8";
+    case CompressedBVH4: return "bvh4q";
+    case CompressedBVH8: return "bvh8q";
+    case KDTreeSAH: return "kdtree";
+    case TwoLevelGrid: return "grid";
+    default: return "bvh2";
+    }
+}
+
+// Whether the layout is traversed through the binary BVH or one collapsed from it
+inline bool IsBVHLayout(AccTreeLayout layout) {
+    return layout != KDTreeSAH && layout != TwoLevelGrid;
+}
+
+#if defined(__AVX2__)
+const AccTreeLayout DEFAULT_ACC_TREE_LAYOUT = BVH8;
+#else
+const AccTreeLayout DEFAULT_ACC_TREE_LAYOUT = BVH4;
+#endif
+
+// Children bounds are stored as SoA so a ray can be tested against all of them at once
+template <int Width>
+struct alignas(32) WideBVHNode {
+    float minX[Width];
+    float minY[Width];
+    float minZ[Width];
+    float maxX[Width];
+    float maxY[Width];
+    float maxZ[Width];
+    int child[Width];                // interior child: node index, leaf child: first entry in BVH::triangleIndices
+    uint16_t triangleCount[Width];   // 0 for interior children
+    int childCount;
+
+    WideBVHNode() : childCount(0) {
+        for (int i = 0; i < Width; i++) {
+            minX[i] = minY[i] = minZ[i] = std::numeric_limits<float>::infinity();
+            maxX[i] = maxY[i] = maxZ[i] = -std::numeric_limits<float>::infinity();
+            child[i] = -1;
+            triangleCount[i] = 0;
+        }
+    }
+};
+
+// Slab test of one ray against four children, returns the bit mask of hit children.
+// The near/far planes are already picked by the ray's sign bits; max/min take the accumulator as the second
+// operand so a NaN slab (origin on a plane of an axis the ray is parallel to) leaves it unchanged.
+inline int IntersectFourChildren(const float* nearX, const float* nearY, const float* nearZ, const float* farX, const float* farY, const float* farZ,
+    const Ray& ray, float tMax, float* entryDistances) {
+    __m128 originX = _mm_set1_ps(ray.origin.x);
+    __m128 originY = _mm_set1_ps(ray.origin.y);
+    __m128 originZ = _mm_set1_ps(ray.origin.z);
+    __m128 inverseX = _mm_set1_ps(ray.inverseDirection.x);
+    __m128 inverseY = _mm_set1_ps(ray.inverseDirection.y);
+    __m128 inverseZ = _mm_set1_ps(ray.inverseDirection.z);
+
+    __m128 tEntry = _mm_setzero_ps();
+    __m128 tExit = _mm_set1_ps(tMax);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), originX), inverseX), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), originX), inverseX), tExit);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), originY), inverseY), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), originY), inverseY), tExit);
+    tEntry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), originZ), inverseZ), tEntry);
+    tExit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), originZ), inverseZ), tExit);
+
+    _mm_storeu_ps(entryDistances, tEntry);
+    return _mm_movemask_ps(_mm_cmple_ps(tEntry, tExit));
+}
+
+#if defined(__AVX2__)
+// Slab test of one ray against eight children, returns the bit mask of hit children
+inline int IntersectEightChildren(const float* nearX, const float* nearY, const float* nearZ, const float* farX, const float* farY, const float* farZ,
+    const Ray& ray, float tMax, float* entryDistances) {
+    __m256 originX = _mm256_set1_ps(ray.origin.x);
+    __m256 originY = _mm256_set1_ps(ray.origin.y);
+    __m256 originZ = _mm256_set1_ps(ray.origin.z);
+    __m256 inverseX = _mm256_set1_ps(ray.inverseDirection.x);
+    __m256 inverseY = _mm256_set1_ps(ray.inverseDirection.y);
+    __m256 inverseZ = _mm256_set1_ps(ray.inverseDirection.z);
+
+    __m256 tEntry = _mm256_setzero_ps();
+    __m256 tExit = _mm256_set1_ps(tMax);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), originX), inverseX), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), originX), inverseX), tExit);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), originY), inverseY), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), originY), inverseY), tExit);
+    tEntry = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), originZ), inverseZ), tEntry);
+    tExit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), originZ), inverseZ), tExit);
+
+    _mm256_storeu_ps(entryDistances, tEntry);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ));
+}
+#endif
+
+template <int Width>
+struct WideBVH {
+    static_assert(Width == 4 || Width == 8, "WideBVH supports 4 and 8 children per node");
+
+    typedef WideBVHNode<Width> Node;
+    static constexpr int WIDTH = Width;
+
+    std::vector<Node> nodes;
+
+    // Collapses the binary tree, leaves keep referring to binary.triangleIndices
+    void build(const BVH& binary) {
+        nodes.clear();
+        if (binary.nodes.empty()) return;
+
+        nodes.reserve(binary.nodes.size() / 2 + 1);
+        collapseNode(binary, 0);
+        nodes.shrink_to_fit();
+    }
+
+    inline int intersectChildren(const WideBVHNode<Width>& node, const Ray& ray, float tMax, float* entryDistances) const {
+        const float* nearX = ray.sign[0] ? node.maxX : node.minX;
+        const float* farX = ray.sign[0] ? node.minX : node.maxX;
+        const float* nearY = ray.sign[1] ? node.maxY : node.minY;
+        const float* farY = ray.sign[1] ? node.minY : node.maxY;
+        const float* nearZ = ray.sign[2] ? node.maxZ : node.minZ;
+        const float* farZ = ray.sign[2] ? node.minZ : node.maxZ;
+
+        int mask;
+        if constexpr (Width == 4) {
+            mask = IntersectFourChildren(nearX, nearY, nearZ, farX, farY, farZ, ray, tMax, entryDistances);
+        }
+        else {
+#if defined(__AVX2__)
+            mask = IntersectEightChildren(nearX, nearY, nearZ, farX, farY, farZ, ray, tMax, entryDistances);
+#else
+            mask = IntersectFourChildren(nearX, nearY, nearZ, farX, farY, farZ, ray, tMax, entryDistances) |
+                (IntersectFourChildren(nearX + 4, nearY + 4, nearZ + 4, farX + 4, farY + 4, farZ + 4, ray, tMax, entryDistances + 4) << 4);
+#endif
+        }
+        return mask & ((1 << node.childCount) - 1);
+    }
+
+private:
+    int collapseNode(const BVH& binary, int binaryNodeIndex) {
+        int children[Width];
+        int childCount = 0;
+
+        if (binary.nodes[binaryNodeIndex].isLeaf()) {
+            children[childCount++] = binaryNodeIndex;
+        }
+        else {
+            children[childCount++] = binaryNodeIndex + 1;
+            children[childCount++] = binary.nodes[binaryNodeIndex].secondChild;
+
+            // Keep opening the largest interior child until the node is full
+            while (childCount < Width) {
+                int largest = -1;
+                float largestArea = -1;
+                for (int i = 0; i < childCount; i++) {
+                    const BVHNode& binaryChild = binary.nodes[children[i]];
+                    if (!binaryChild.isLeaf() && binaryChild.bounds.surfaceArea() > largestArea) {
+                        largest = i;
+                        largestArea = binaryChild.bounds.surfaceArea();
+                    }
+                }
+                if (largest == -1) break;
+
+                int opened = children[largest];
+                children[largest] = opened + 1;
+                children[childCount++] = binary.nodes[opened].secondChild;
+            }
+        }
+
+        int nodeIndex = (int)nodes.size();
+        nodes.emplace_back();
+        nodes[nodeIndex].childCount = childCount;
+
+        for (int i = 0; i < childCount; i++) {
+            const BVHNode& binaryChild = binary.nodes[children[i]];
+            nodes[nodeIndex].minX[i] = binaryChild.bounds.min.x;
+            nodes[nodeIndex].minY[i] = binaryChild.bounds.min.y;
+            nodes[nodeIndex].minZ[i] = binaryChild.bounds.min.z;
+            nodes[nodeIndex].maxX[i] = binaryChild.bounds.max.x;
+            nodes[nodeIndex].maxY[i] = binaryChild.bounds.max.y;
+            nodes[nodeIndex].maxZ[i] = binaryChild.bounds.max.z;
+
+            if (binaryChild.isLeaf()) {
+                nodes[nodeIndex].child[i] = binaryChild.firstTriangle;
+                nodes[nodeIndex].triangleCount[i] = binaryChild.triangleCount;
+            }
+            else {
+                int childNodeIndex = collapseNode(binary, children[i]);
+                nodes[nodeIndex].child[i] = childNodeIndex;
+            }
+        }
+
+        return nodeIndex;
+    }
+};